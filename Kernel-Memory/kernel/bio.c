@@ -1,7 +1,8 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
-// cached copies of disk block contents.  Caching disk blocks
+// The buffer cache is a set of buf structures holding
+// cached copies of disk block contents, found through a hash
+// on (dev, blockno).  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
@@ -12,6 +13,11 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Buffers come from the "buf" kmem_cache. The cache grows while
+// fewer than NBUF buffers are idle and a new block is needed, and
+// brelse() frees the least recently used idle buffer once more than
+// NBUF are idle, so memory tracks the number of blocks in use.
 
 
 #include "types.h"
@@ -22,34 +28,102 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "slab.h"
+
+#define NBHASH 31
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct kmem_cache *cache;
+  struct buf *hash[NBHASH];
 
-  // Linked list of all buffers, through prev/next.
+  // Linked list of idle (refcnt == 0) buffers, through prev/next.
   // Sorted by how recently the buffer was used.
   // head.next is most recent, head.prev is least.
   struct buf head;
+  int nidle;
 } bcache;
 
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBHASH)
+
+// Slab constructor: the sleep-lock is initialized once per
+// object and is left released whenever the object is freed.
+static void
+buf_ctor(void *obj)
+{
+  struct buf *b = obj;
+
+  memset(b, 0, sizeof(*b));
+  initsleeplock(&b->lock, "buffer");
+}
+
 void
 binit(void)
 {
-  struct buf *b;
-
   initlock(&bcache.lock, "bcache");
+  bcache.cache = kmem_cache_create_ext("buf", sizeof(struct buf),
+                                       SLAB_HWCACHE_ALIGN, buf_ctor, 0);
+  if(bcache.cache == 0)
+    panic("binit");
 
-  // Create linked list of buffers
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+}
+
+// Find the cached buffer for (dev, blockno), taking a reference.
+// Caller must hold bcache.lock.
+static struct buf*
+blookup(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bcache.hash[BHASH(dev, blockno)]; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno){
+      if(b->refcnt++ == 0){
+        b->next->prev = b->prev;
+        b->prev->next = b->next;
+        bcache.nidle--;
+      }
+      return b;
+    }
   }
+  return 0;
+}
+
+// Remove b from the hash. Caller must hold bcache.lock.
+static void
+bunhash(struct buf *b)
+{
+  struct buf **bp;
+
+  for(bp = &bcache.hash[BHASH(b->dev, b->blockno)]; *bp != b; bp = &(*bp)->hnext)
+    ;
+  *bp = b->hnext;
+  b->hnext = 0;
+}
+
+// b's last reference is gone: put it at the head of the
+// idle list. If that leaves more than NBUF idle buffers,
+// unhash the least recently used one and return it so the
+// caller can free it after releasing bcache.lock.
+static struct buf*
+bidle(struct buf *b)
+{
+  struct buf *victim;
+
+  b->next = bcache.head.next;
+  b->prev = &bcache.head;
+  bcache.head.next->prev = b;
+  bcache.head.next = b;
+  if(++bcache.nidle <= NBUF)
+    return 0;
+
+  victim = bcache.head.prev;
+  victim->next->prev = victim->prev;
+  victim->prev->next = victim->next;
+  bcache.nidle--;
+  bunhash(victim);
+  return victim;
 }
 
 // Look through buffer cache for block on device dev.
@@ -58,34 +132,52 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct buf *b, *new;
 
   acquire(&bcache.lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
-  }
+  if((b = blookup(dev, blockno)) != 0)
+    goto found;
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  // Grow the cache unless enough buffers sit idle. Allocate
+  // without bcache.lock, since the slab allocator may reap.
+  new = 0;
+  if(bcache.nidle < NBUF){
+    release(&bcache.lock);
+    new = kmem_cache_alloc(bcache.cache);
+    acquire(&bcache.lock);
+    if((b = blookup(dev, blockno)) != 0){
       release(&bcache.lock);
+      if(new)
+        kmem_cache_free(bcache.cache, new);
       acquiresleep(&b->lock);
       return b;
     }
   }
-  panic("bget: no buffers");
+
+  if((b = new) == 0){
+    // Recycle the least recently used (LRU) idle buffer.
+    if(bcache.nidle == 0)
+      panic("bget: no buffers");
+    b = bcache.head.prev;
+    b->next->prev = b->prev;
+    b->prev->next = b->next;
+    bcache.nidle--;
+    bunhash(b);
+  }
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->hnext = bcache.hash[BHASH(dev, blockno)];
+  bcache.hash[BHASH(dev, blockno)] = b;
+
+found:
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -116,6 +208,8 @@ bwrite(struct buf *b)
 void
 brelse(struct buf *b)
 {
+  struct buf *victim = 0;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
@@ -125,15 +219,12 @@ brelse(struct buf *b)
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    victim = bidle(b);
   }
-  
   release(&bcache.lock);
+
+  if(victim)
+    kmem_cache_free(bcache.cache, victim);
 }
 
 void
@@ -145,9 +236,14 @@ bpin(struct buf *b) {
 
 void
 bunpin(struct buf *b) {
+  struct buf *victim = 0;
+
   acquire(&bcache.lock);
   b->refcnt--;
+  if(b->refcnt == 0)
+    victim = bidle(b);
   release(&bcache.lock);
-}
-
 
+  if(victim)
+    kmem_cache_free(bcache.cache, victim);
+}
@@ -5,7 +5,8 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  struct buf *hnext; // hash chain
+  struct buf *prev; // LRU list of idle buffers
   struct buf *next;
   uchar data[BSIZE];
 };
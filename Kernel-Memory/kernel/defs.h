@@ -1,9 +1,12 @@
 struct buf;
 struct context;
+struct execseg;
+struct vma;
 struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct spawnact;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -24,11 +27,16 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execproc(struct proc*, char*, char**);
+int             execfault(struct proc*, struct execseg*, uint64);
 
 // file.c
 struct file*    filealloc(void);
+int             filealloc_bulk(struct file**, int);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
+void            filedup_bulk(struct file**, int);
+void            fileclose_bulk(struct file**, int);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
@@ -61,8 +69,15 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kzalloc(void);
+int             kzero_refill(void);
 void            kfree(void *);
+void            kdup(void *);
+int             krefs(void *);
 void            kinit(void);
+void*           kallocpages(int);
+void            kfreepages(void *, int);
+void            ksplit(void *, int);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -83,10 +98,11 @@ void            printfinit(void);
 
 // proc.c
 int             cpuid(void);
+void            proc_mapstacks(pagetable_t);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, struct spawnact*, int);
 int             growproc(int);
-void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -113,11 +129,16 @@ void            swtch(struct context*, struct context*);
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holdingany(void);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+void            slabinit(void);
+int             kmem_cache_reap(void);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -133,6 +154,16 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// sysfile.c
+struct vma*     mmaplookup(struct proc*, uint64);
+int             mmapfault(struct proc*, struct vma*, uint64, pte_t*);
+uint64          mmapbase(struct proc*);
+void            mmapclear(struct proc*);
+int             mmapfork(struct proc*, struct proc*);
+
+// sysproc.c
+void            slabbenchinit(void);
+
 // syscall.c
 void            argint(int, int*);
 int             argstr(int, char*, int);
@@ -165,11 +196,20 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
+void            uvmflush(pagetable_t, uint64, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             uvmlazy(pagetable_t, uint64);
+int             uvmdemote(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
+uint64          walkskip(pagetable_t, uint64);
+uint64          uvmsatp(struct proc*);
+void            uvmmigrate(struct proc*);
+int             uvmprefault(pagetable_t, uint64, uint64, int);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
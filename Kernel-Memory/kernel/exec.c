@@ -3,11 +3,12 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
-
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
+#include "fs.h"
+#include "file.h"
 
 int flags2perm(int flags)
 {
@@ -21,15 +22,24 @@ int flags2perm(int flags)
 
 int
 exec(char *path, char **argv)
+{
+  return execproc(myproc(), path, argv);
+}
+
+// Replace p's user image with the program at path. p is the
+// current process, or a child being built by spawn() that has
+// not run yet. Returns argc, or -1 with p unchanged.
+int
+execproc(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe = 0, *oldexe;
   struct proghdr ph;
+  struct execseg seg[NEXECSEG];
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
   begin_op();
 
@@ -49,7 +59,8 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program segments. Their pages are read in
+  // by execfault() when the program first touches them.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -61,18 +72,23 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz > TRAPFRAME)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(nseg == NEXECSEG)
       goto bad;
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].memsz = ph.memsz;
+    seg[nseg].filesz = ph.filesz;
+    seg[nseg].off = ph.off;
+    seg[nseg].perm = flags2perm(ph.flags) | PTE_R | PTE_U;
+    nseg++;
+    sz = ph.vaddr + ph.memsz;
   }
+  exe = idup(ip);
   iunlockput(ip);
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate some pages at the next page boundary.
@@ -121,12 +137,23 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  mmapclear(p);
   oldpagetable = p->pagetable;
+  oldexe = p->exe;
   p->pagetable = pagetable;
+  p->asid = 0;  // the old image's TLB entries keep the old ASID
   p->sz = sz;
+  p->exe = exe;
+  memmove(p->seg, seg, sizeof(seg));
+  p->nseg = nseg;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexe){
+    begin_op();
+    iput(oldexe);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -137,30 +164,48 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exe){
+    begin_op();
+    iput(exe);
+    end_op();
+  }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
+// Read the page at va of segment sg in from the current
+// process's executable and map it.
+// The page must not be mapped yet.
 // Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+int
+execfault(struct proc *p, struct execseg *sg, uint64 va)
 {
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
+  uint64 n = 0;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  if((mem = kzalloc()) == 0)
+    return -1;
+  if(va < sg->va + sg->filesz){
+    n = sg->va + sg->filesz - va;
+    if(n > PGSIZE)
       n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
+    // ilock() may sleep. copies made under a spinlock fault
+    // their pages in beforehand (see uvmprefault), so this
+    // is only reached if that failed.
+    if(holdingany())
+      goto bad;
+    ilock(p->exe);
+    if(readi(p->exe, 0, (uint64)mem, sg->off + (va - sg->va), n) != n){
+      iunlock(p->exe);
+      goto bad;
+    }
+    iunlock(p->exe);
   }
-  
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, sg->perm) != 0)
+    goto bad;
   return 0;
+
+ bad:
+  kfree(mem);
+  return -1;
 }
@@ -21,18 +21,30 @@ void fileprint_metadata(void *f) {
 }
 
 struct devsw devsw[NDEV];
+// Files are allocated from file_cache; ftable.lock only
+// protects the reference counts of open files.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
 } ftable;
 
 struct kmem_cache *file_cache;
 
+// file_cache constructor: a constructed file is unused and
+// all zero. fileclose() puts files back in this state.
+static void
+file_ctor(void *f)
+{
+  memset(f, 0, sizeof(struct file));
+}
+
 void
 fileinit(void)
 {
   debug("[FILE] fileinit\n"); // example of using debug, you can modify this
   initlock(&ftable.lock, "ftable");
+  file_cache = kmem_cache_create_ext("file", sizeof(struct file), SLAB_HWCACHE_ALIGN, file_ctor, 0);
+  if(file_cache == 0)
+    panic("fileinit: file_cache");
 }
 
 // Allocate a file structure.
@@ -42,15 +54,29 @@ filealloc(void)
   debug("[FILE] filealloc\n"); // example of using debug, you can modify this
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if((f = kmem_cache_alloc(file_cache)) == 0)
+    return 0;
+  if(f->ref != 0 || f->type != FD_NONE)
+    panic("filealloc");
+  f->ref = 1;
+  return f;
+}
+
+// Allocate n file structures into files[] with one trip to
+// file_cache, as pipealloc() needs two at once.
+// Returns 0, or -1 with none allocated.
+int
+filealloc_bulk(struct file **files, int n)
+{
+  int i;
+
+  if(kmem_cache_alloc_bulk(file_cache, n, (void **)files) != n)
+    return -1;
+  for(i = 0; i < n; i++){
+    if(files[i]->ref != 0 || files[i]->type != FD_NONE)
+      panic("filealloc_bulk");
+    files[i]->ref = 1;
   }
-  release(&ftable.lock);
   return 0;
 }
 
@@ -66,12 +92,50 @@ filedup(struct file *f)
   return f;
 }
 
+// Increment ref counts of the n files in files[],
+// skipping null entries, under one acquisition of ftable.lock.
+void
+filedup_bulk(struct file **files, int n)
+{
+  int i;
+
+  acquire(&ftable.lock);
+  for(i = 0; i < n; i++){
+    if(files[i] == 0)
+      continue;
+    if(files[i]->ref < 1)
+      panic("filedup_bulk");
+    files[i]->ref++;
+  }
+  release(&ftable.lock);
+}
+
+// Tear down a file whose ref count has dropped to 0 and put it
+// back in its constructed state. Does not free it.
+static void
+filerelease(struct file *f)
+{
+  debug("[FILE] fileclose\n"); // example of using debug, you can modify this
+  if(f->type == FD_PIPE){
+    pipeclose(f->pipe, f->writable);
+  } else if(f->type == FD_INODE || f->type == FD_DEVICE){
+    begin_op();
+    iput(f->ip);
+    end_op();
+  }
+  f->type = FD_NONE;
+  f->readable = 0;
+  f->writable = 0;
+  f->pipe = 0;
+  f->ip = 0;
+  f->off = 0;
+  f->major = 0;
+}
+
 // Close file f.  (Decrement ref count, close when reaches 0.)
 void
 fileclose(struct file *f)
 {
-  struct file ff;
-
   acquire(&ftable.lock);
   if(f->ref < 1)
     panic("fileclose");
@@ -79,18 +143,37 @@ fileclose(struct file *f)
     release(&ftable.lock);
     return;
   }
-  debug("[FILE] fileclose\n"); // example of using debug, you can modify this
-  ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
 
-  if(ff.type == FD_PIPE){
-    pipeclose(ff.pipe, ff.writable);
-  } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op();
-    iput(ff.ip);
-    end_op();
+  filerelease(f);
+  kmem_cache_free(file_cache, f);
+}
+
+// Close the n files in files[], skipping null entries.
+// Ref counts are dropped a batch at a time under one acquisition
+// of ftable.lock, and the dead files go back to file_cache together.
+void
+fileclose_bulk(struct file **files, int n)
+{
+  struct file *dead[16];
+  int i = 0, j, k;
+
+  while(i < n){
+    k = 0;
+    acquire(&ftable.lock);
+    for(; i < n && k < NELEM(dead); i++){
+      if(files[i] == 0)
+        continue;
+      if(files[i]->ref < 1)
+        panic("fileclose_bulk");
+      if(--files[i]->ref == 0)
+        dead[k++] = files[i];
+    }
+    release(&ftable.lock);
+
+    for(j = 0; j < k; j++)
+      filerelease(dead[j]);
+    kmem_cache_free_bulk(file_cache, k, (void **)dead);
   }
 }
 
@@ -130,6 +213,12 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    // fault the buffer in before ilock(): faulting in a page of
+    // a file or executable under another inode's lock could
+    // deadlock. ip->size is only a hint here.
+    if(n > 0 && f->off < f->ip->size)
+      uvmprefault(myproc()->pagetable, addr,
+                  n < f->ip->size - f->off ? n : f->ip->size - f->off, 1);
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
@@ -171,6 +260,8 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
+      // as in fileread().
+      uvmprefault(myproc()->pagetable, addr + i, n1, 0);
       begin_op();
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
@@ -164,28 +165,138 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
+// Table entries come from the "inode" kmem_cache when iget()
+// first needs them and are found through a hash on (dev, inum).
+// When iput() drops the last reference to a valid inode the
+// entry stays hashed on an LRU list of idle inodes, so that the
+// next lookup need not read it from disk again; beyond NINODE
+// idle entries, and whenever the slab allocator reaps, the least
+// recently used go back to the cache.
+//
 // The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// entries and the hash chains. Since ip->ref indicates whether
+// an entry is in use, and ip->dev and ip->inum indicate which
+// i-node an entry holds, one must hold itable.lock while using
+// any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 61
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  struct inode *hash[NIHASH];
+
+  // Linked list of idle (ref == 0) inodes, through prev/next.
+  // head.next is most recently used, head.prev is least.
+  struct inode head;
+  int nidle;
 } itable;
 
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
+// Slab constructor: the sleep-lock is initialized once per
+// object and is left released whenever the object is freed.
+static void
+inode_ctor(void *obj)
+{
+  struct inode *ip = obj;
+
+  memset(ip, 0, sizeof(*ip));
+  initsleeplock(&ip->lock, "inode");
+}
+
+static void ishrink(void);
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  itable.cache = kmem_cache_create_ext("inode", sizeof(struct inode),
+                                       SLAB_HWCACHE_ALIGN, inode_ctor, 0);
+  if(itable.cache == 0)
+    panic("iinit");
+  itable.head.prev = &itable.head;
+  itable.head.next = &itable.head;
+  kmem_register_shrinker(ishrink);
+}
+
+// Find (dev, inum) in the hash, taking a reference.
+// Caller must hold itable.lock.
+static struct inode*
+ilookup(uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = itable.hash[IHASH(dev, inum)]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0){
+        ip->next->prev = ip->prev;
+        ip->prev->next = ip->next;
+        itable.nidle--;
+      }
+      return ip;
+    }
+  }
+  return 0;
+}
+
+// Remove ip from the hash. Caller must hold itable.lock.
+static void
+iunhash(struct inode *ip)
+{
+  struct inode **hp;
+
+  for(hp = &itable.hash[IHASH(ip->dev, ip->inum)]; *hp != ip; hp = &(*hp)->hnext)
+    ;
+  *hp = ip->hnext;
+  ip->hnext = 0;
+}
+
+// Take the least recently used idle inode off the LRU and out
+// of the hash, for the caller to free after releasing
+// itable.lock. Caller must hold itable.lock; nidle > 0.
+static struct inode*
+ievict(void)
+{
+  struct inode *ip;
+
+  ip = itable.head.prev;
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+  itable.nidle--;
+  iunhash(ip);
+  return ip;
+}
+
+// Give an unhashed, unreferenced entry back to the inode cache.
+static void
+ifree(struct inode *ip)
+{
+  ip->dev = 0;
+  ip->inum = 0;
+  ip->valid = 0;
+  kmem_cache_free(itable.cache, ip);
+}
+
+// Shrinker for kmem_cache_reap(): free every idle inode.
+static void
+ishrink(void)
+{
+  struct inode *ip;
+
+  for(;;){
+    acquire(&itable.lock);
+    if(itable.nidle == 0){
+      release(&itable.lock);
+      return;
+    }
+    ip = ievict();
+    release(&itable.lock);
+    ifree(ip);
   }
 }
 
@@ -246,31 +357,38 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, *new;
+  struct inode **hp;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  if((ip = ilookup(dev, inum)) != 0){
+    release(&itable.lock);
+    return ip;
   }
+  release(&itable.lock);
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Allocate an entry without holding itable.lock, since
+  // the slab allocator may have to reap other caches.
+  if((new = kmem_cache_alloc(itable.cache)) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
+  acquire(&itable.lock);
+  // Someone else may have entered it meanwhile.
+  if((ip = ilookup(dev, inum)) != 0){
+    release(&itable.lock);
+    kmem_cache_free(itable.cache, new);
+    return ip;
+  }
+  ip = new;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  hp = &itable.hash[IHASH(dev, inum)];
+  ip->hnext = *hp;
+  *hp = ip;
   release(&itable.lock);
 
   return ip;
@@ -327,8 +445,9 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry goes
+// on the idle LRU, or back to the inode cache if it holds no
+// valid inode.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -336,6 +455,8 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct inode *victim = 0;
+
   acquire(&itable.lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
@@ -357,8 +478,28 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref > 0){
+    release(&itable.lock);
+    return;
+  }
+
+  if(!ip->valid){
+    iunhash(ip);
+    release(&itable.lock);
+    ifree(ip);
+    return;
+  }
+
+  ip->next = itable.head.next;
+  ip->prev = &itable.head;
+  itable.head.next->prev = ip;
+  itable.head.next = ip;
+  if(++itable.nidle > NINODE)
+    victim = ievict();
   release(&itable.lock);
+
+  if(victim)
+    ifree(victim);
 }
 
 // Common idiom: unlock, then put.
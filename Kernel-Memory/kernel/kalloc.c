@@ -1,6 +1,15 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages, or
+// naturally aligned runs of 2^order pages for multi-page slabs
+// and other physically contiguous buffers.
+//
+// Free memory is kept by a binary buddy allocator: one freelist
+// per order, 0..MAXORDER, where a block of order k is 2^k pages
+// aligned to its size. Freeing a block merges it with its buddy
+// (the other half of the enclosing order k+1 block) whenever
+// that buddy is free too. Single pages are additionally cached
+// per hart, which makes kalloc()/kfree() the fast path.
 
 #include "types.h"
 #include "param.h"
@@ -16,67 +25,485 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;
 };
 
+#define MAXORDER 10     // largest block: 2^MAXORDER pages (4 MiB)
+
+// The global pool. order[i] is k+1 if page i heads a free block
+// of order k, and 0 otherwise, so a buddy can be checked and
+// unlinked from its doubly-linked freelist in O(1).
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run *freelist[MAXORDER+1];
+  char order[NPAGES];
 } kmem;
 
+#define IDX2PA(i) ((struct run*)(KERNBASE + (uint64)(i) * PGSIZE))
+
+// Each hart keeps a short LIFO list of pages, refilled from and
+// drained to the global pool PCP_BATCH pages at a time, so that
+// most kalloc()/kfree() calls touch only the hart's own lock.
+// Pages on these lists are not free as far as the buddy
+// allocator is concerned, so they cannot be merged.
+#define PCP_BATCH 16
+#define PCP_HIGH  (4 * PCP_BATCH)
+
+struct kmem_pcp {
+  struct spinlock lock;
+  struct run *list;     // singly linked through next
+  int count;
+} __attribute__((aligned(64)));
+
+static struct kmem_pcp pcp[NCPU];
+
+// References to each page handed out by kalloc(): 1 when allocated,
+// more while copy-on-write mappings share it. kfree() frees the page
+// when the last reference goes. Updated with atomic instructions.
+static int pageref[NPAGES];
+
+// Pages zeroed ahead of time by idle harts (see kzero_refill),
+// handed out by kzalloc(). Linked through next; the link word is
+// cleared again when a page leaves the pool.
+#define ZPOOL_HIGH  128
+#define ZPOOL_BATCH 8
+
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int count;
+} zpool;
+
+// Push r onto the order k freelist. Caller must hold kmem.lock.
+static void
+push_run(struct run *r, int k)
+{
+  r->next = kmem.freelist[k];
+  r->prev = 0;
+  if(kmem.freelist[k])
+    kmem.freelist[k]->prev = r;
+  kmem.freelist[k] = r;
+  kmem.order[PA2IDX(r)] = k + 1;
+}
+
+// Unlink r from the order k freelist. Caller must hold kmem.lock.
+static void
+unlink_run(struct run *r, int k)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.freelist[k] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  kmem.order[PA2IDX(r)] = 0;
+}
+
+// Take a block of order k, splitting a larger one if needed.
+// Returns 0 if there is none. Caller must hold kmem.lock.
+static struct run*
+buddy_alloc(int k)
+{
+  struct run *r;
+  int j;
+
+  for(j = k; j <= MAXORDER && kmem.freelist[j] == 0; j++)
+    ;
+  if(j > MAXORDER)
+    return 0;
+  r = kmem.freelist[j];
+  unlink_run(r, j);
+  // give back the upper halves.
+  while(j > k){
+    j--;
+    push_run((struct run*)((char*)r + ((uint64)PGSIZE << j)), j);
+  }
+  return r;
+}
+
+// Free the order k block r, merging it with its buddy for as
+// long as the buddy is free. Caller must hold kmem.lock.
+static void
+buddy_free(struct run *r, int k)
+{
+  uint64 idx = PA2IDX(r), b;
+
+  for(; k < MAXORDER; k++){
+    b = idx ^ (1L << k);
+    if(b >= NPAGES || kmem.order[b] != k + 1)
+      break;
+    unlink_run(IDX2PA(b), k);
+    idx &= ~(1L << k);
+  }
+  push_run(IDX2PA(idx), k);
+}
+
 void
 kinit()
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  for(i = 0; i < NCPU; i++)
+    initlock(&pcp[i].lock, "kmem_pcp");
+  initlock(&zpool.lock, "zpool");
   freerange(end, (void*)PHYSTOP);
 }
 
+// Hand [pa_start, pa_end) to the buddy allocator directly,
+// page by page; buddies merge as they meet.
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  acquire(&kmem.lock);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    if(KMEM_JUNK)
+      memset(p, 1, PGSIZE);
+    buddy_free((struct run*)p, 0);
+  }
+  release(&kmem.lock);
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Move up to n pages from the global pool to c.
+// Caller must hold c->lock.
+static void
+pcp_refill(struct kmem_pcp *c, int n)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  while(n-- > 0 && (r = buddy_alloc(0)) != 0){
+    r->next = c->list;
+    c->list = r;
+    c->count++;
+  }
+  release(&kmem.lock);
+}
+
+// Move up to n pages from c back to the global pool.
+// Caller must hold c->lock.
+static void
+pcp_drain(struct kmem_pcp *c, int n)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  while(n-- > 0 && (r = c->list) != 0){
+    c->list = r->next;
+    c->count--;
+    buddy_free(r, 0);
+  }
+  release(&kmem.lock);
+}
+
+// Return every hart's cached pages to the global pool, so that
+// kallocpages() can see them.
+static void
+pcp_drain_all(void)
+{
+  int i;
+
+  for(i = 0; i < NCPU; i++){
+    acquire(&pcp[i].lock);
+    pcp_drain(&pcp[i], pcp[i].count);
+    release(&pcp[i].lock);
+  }
+}
+
+// Both the local list and the global pool are empty: take half
+// of another hart's list. Returns one page and keeps the rest on
+// hart id's list. Called without any pcp lock held.
+static struct run*
+pcp_steal(int id)
+{
+  struct run *r, *first, *last;
+  int i, n;
+
+  for(i = 1; i < NCPU; i++){
+    struct kmem_pcp *v = &pcp[(id + i) % NCPU];
+    if(v->count == 0)
+      continue;
+    acquire(&v->lock);
+    n = (v->count + 1) / 2;
+    first = last = v->list;
+    if(first == 0){
+      release(&v->lock);
+      continue;
+    }
+    for(r = first; --n > 0 && r->next; r = r->next)
+      v->count--;
+    last = r;
+    v->list = last->next;
+    v->count--;
+    release(&v->lock);
+
+    // hand out first, keep the rest.
+    if(first != last){
+      acquire(&pcp[id].lock);
+      for(r = first->next; ; r = r->next){
+        pcp[id].count++;
+        if(r == last)
+          break;
+      }
+      last->next = pcp[id].list;
+      pcp[id].list = first->next;
+      release(&pcp[id].lock);
+    }
+    return first;
+  }
+  return 0;
+}
+
+// Drop a reference to the page of physical memory pointed at
+// by pa, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmem_pcp *c;
+  int ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((ref = __sync_sub_and_fetch(&pageref[PA2IDX(pa)], 1)) > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: ref");
+
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  if(KMEM_JUNK)
+    memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
+  push_off();
+  c = &pcp[cpuid()];
+  acquire(&c->lock);
+  r->next = c->list;
+  c->list = r;
+  if(++c->count > PCP_HIGH)
+    pcp_drain(c, PCP_BATCH);
+  release(&c->lock);
+  pop_off();
+}
+
+// Take a page from this hart's list, refilling it from the
+// global pool or stealing from another hart if needed.
+static struct run*
+pcp_alloc(void)
+{
+  struct run *r;
+  struct kmem_pcp *c;
+  int id;
+
+  push_off();
+  id = cpuid();
+  c = &pcp[id];
+  acquire(&c->lock);
+  if(c->count == 0)
+    pcp_refill(c, PCP_BATCH);
+  if((r = c->list) != 0){
+    c->list = r->next;
+    c->count--;
+  }
+  release(&c->lock);
+  if(r == 0)
+    r = pcp_steal(id);
+  pop_off();
+  return r;
+}
+
+// Take a page from the pre-zeroed pool, or return 0.
+static struct run*
+zpool_take(void)
+{
+  struct run *r;
+
+  acquire(&zpool.lock);
+  if((r = zpool.list) != 0){
+    zpool.list = r->next;
+    zpool.count--;
+  }
+  release(&zpool.lock);
+  if(r)
+    r->next = 0;
+  return r;
+}
+
+// Give the pre-zeroed pool back to the global pool.
+static void
+zpool_drain(void)
+{
+  struct run *r;
+
+  acquire(&zpool.lock);
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  while((r = zpool.list) != 0){
+    zpool.list = r->next;
+    zpool.count--;
+    buddy_free(r, 0);
+  }
   release(&kmem.lock);
+  release(&zpool.lock);
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// When no hart has a free page, falls back on the pre-zeroed
+// pool and then asks the slab caches to give back their idle
+// slabs before failing.
 void *
 kalloc(void)
 {
   struct run *r;
 
+  for(;;){
+    if((r = pcp_alloc()) == 0)
+      r = zpool_take();
+    if(r || kmem_cache_reap() == 0)
+      break;
+  }
+
+  if(r == 0)
+    return 0;
+  pageref[PA2IDX(r)] = 1;
+  if(KMEM_JUNK)
+    memset((char*)r, 5, PGSIZE); // fill with junk
+  return (void*)r;
+}
+
+// Turn a block returned by kallocpages(order) into 2^order
+// separate pages, each as if returned by kalloc(), so that they
+// can be shared and freed one at a time with kdup()/kfree().
+void
+ksplit(void *pa, int order)
+{
+  uint64 i;
+
+  for(i = 0; i < (1L << order); i++)
+    pageref[PA2IDX(pa) + i] = 1;
+}
+
+// Add a reference to a page returned by kalloc().
+void
+kdup(void *pa)
+{
+  if(__sync_fetch_and_add(&pageref[PA2IDX(pa)], 1) <= 0)
+    panic("kdup");
+}
+
+// Number of references to a page returned by kalloc().
+int
+krefs(void *pa)
+{
+  return __atomic_load_n(&pageref[PA2IDX(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Allocate one zero-filled page, from the pre-zeroed pool
+// if it has one. Returns 0 if the memory cannot be allocated.
+void *
+kzalloc(void)
+{
+  struct run *r;
+
+  if((r = zpool_take()) != 0){
+    pageref[PA2IDX(r)] = 1;
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Called by an idle hart: zero up to ZPOOL_BATCH free pages into
+// the pre-zeroed pool, stopping early once it holds ZPOOL_HIGH.
+// Pages come only from the global buddy pool, never from the
+// harts' lists, which busy harts are using. Returns the number
+// of pages zeroed, so the caller can look for runnable processes
+// again before sleeping.
+int
+kzero_refill(void)
+{
+  struct run *r;
+  int n;
+
+  for(n = 0; n < ZPOOL_BATCH && zpool.count < ZPOOL_HIGH; n++){
+    acquire(&kmem.lock);
+    r = buddy_alloc(0);
+    release(&kmem.lock);
+    if(r == 0)
+      break;
+    memset((char*)r, 0, PGSIZE);
+    acquire(&zpool.lock);
+    r->next = zpool.list;
+    zpool.list = r;
+    zpool.count++;
+    release(&zpool.lock);
+  }
+  return n;
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their total size. Returns 0 if no such block is free.
+// Order 0 is kalloc(); larger orders come from the buddy
+// allocator, pulling back the harts' cached pages so they can
+// merge before giving up.
+void *
+kallocpages(int order)
+{
+  struct run *r;
+  int drained = 0;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAXORDER)
+    return 0;
+
+again:
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  r = buddy_alloc(order);
   release(&kmem.lock);
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r == 0 && !drained){
+    pcp_drain_all();
+    zpool_drain();
+    drained = 1;
+    goto again;
+  }
+  if(r == 0 && kmem_cache_reap() > 0){
+    // reaped single-page slabs went through kfree() onto the
+    // per-hart lists; pull them back so they can merge too.
+    drained = 0;
+    goto again;
+  }
+
+  if(r && KMEM_JUNK)
+    memset((char*)r, 5, (uint64)PGSIZE << order); // fill with junk
   return (void*)r;
 }
+
+// Free a block returned by kallocpages(order).
+// It goes straight to the buddy allocator, to be merged.
+void
+kfreepages(void *pa, int order)
+{
+  uint64 n = 1L << order;
+
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(((uint64)pa % (n * PGSIZE)) != 0 || (char*)pa < end || (uint64)pa + n * PGSIZE > PHYSTOP)
+    panic("kfreepages");
+
+  if(KMEM_JUNK)
+    memset(pa, 1, n * PGSIZE);
+  acquire(&kmem.lock);
+  buddy_free((struct run*)pa, order);
+  release(&kmem.lock);
+}
@@ -19,6 +19,8 @@ main()
     printf("\n");
     check();
     kinit();         // physical page allocator
+    slabinit();      // slab allocator
+    slabbenchinit(); // slabbench() system call
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
@@ -39,6 +39,11 @@
 #define KERNBASE 0x80000000L
 #define PHYSTOP (KERNBASE + 128*1024*1024)
 
+// number of physical pages between KERNBASE and PHYSTOP,
+// and the index of the page holding physical address pa.
+#define NPAGES ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2IDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
 // map the trampoline page to the highest address,
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
@@ -1,19 +1,21 @@
 #pragma once
 
-#define NPROC        64  // maximum number of processes
+#define NPROC        64  // maximum number of processes (KSTACK slots)
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE      200  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE      200  // maximum number of active i-nodes
+#define NINODE      200  // unreferenced i-nodes kept cached
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NBUF         (MAXOPBLOCKS*3)  // idle blocks kept in the disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
+#define KMEM_JUNK       0  // junk-fill pages in kalloc/kfree; 1 to debug
+#define SLAB_MAX_ORDER  3  // slabs span at most 2^SLAB_MAX_ORDER pages
+#define SLAB_WASTE_PCT 12  // max % of a slab a cache may leave unused
 
 // MP2 Macros that CANNOT BE CHANGED!
 #define MP2_DEFAULT_DEBUG_MODE 1 // debug mode on
@@ -8,13 +8,21 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+#define PIPESIZE PGSIZE
+#define PIPEPAGES 16    // whole pages queued by zero-copy writes
 
+// Data is either in the byte ring or, for page-aligned writes of
+// whole pages, in the page queue, never both at once: so the
+// stream stays in order without tagging either.
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // ring buffer, one whole page
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
+  uint64 page[PIPEPAGES]; // pages lent by writers, oldest at pghead
+  int pghead;
+  int npage;      // pages in the queue
+  int pgoff;      // bytes of page[pghead] already read
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
 };
@@ -23,17 +31,25 @@ int
 pipealloc(struct file **f0, struct file **f1)
 {
   struct pipe *pi;
+  struct file *f[2];
 
   pi = 0;
   *f0 = *f1 = 0;
-  if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
+  if(filealloc_bulk(f, 2) < 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  *f0 = f[0];
+  *f1 = f[1];
+  if((pi = (struct pipe*)kmalloc(sizeof(struct pipe))) == 0)
+    goto bad;
+  if((pi->data = kalloc()) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->pghead = 0;
+  pi->npage = 0;
+  pi->pgoff = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -46,8 +62,11 @@ pipealloc(struct file **f0, struct file **f1)
   return 0;
 
  bad:
-  if(pi)
-    kfree((char*)pi);
+  if(pi){
+    if(pi->data)
+      kfree(pi->data);
+    kmfree((char*)pi);
+  }
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,63 +87,180 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    for(; pi->npage > 0; pi->npage--, pi->pghead = (pi->pghead + 1) % PIPEPAGES)
+      kfree((void*)pi->page[pi->pghead]);
+    kfree(pi->data);
+    kmfree((char*)pi);
   } else
     release(&pi->lock);
 }
 
+// Queue the writer's page at va instead of copying it, if va is
+// page-aligned, a whole page remains to be written, and it is an
+// ordinary 4 KiB page outside any mmap() region. The writer keeps
+// the page mapped copy-on-write, so it cannot change what the
+// reader will see. Returns 0 if the page was queued.
+static int
+pipelend(struct pipe *pi, struct proc *pr, uint64 va, int left)
+{
+  pte_t *pte;
+  uint64 pa;
+
+  if(va % PGSIZE != 0 || left < PGSIZE || mmaplookup(pr, va) != 0)
+    return -1;
+  pte = walk(pr->pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_MEGA)) != (PTE_V|PTE_U))
+    return -1;
+  pa = PTE2PA(*pte);
+  if(*pte & PTE_W){
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+    uvmflush(pr->pagetable, va, 1);
+  }
+  kdup((void*)pa);
+  pi->page[(pi->pghead + pi->npage) % PIPEPAGES] = pa;
+  pi->npage++;
+  return 0;
+}
+
+// Move data from the head of the page queue to the reader's va.
+// A whole untouched page going to a page-aligned, writable 4 KiB
+// page is remapped in place of that page, copy-on-write since the
+// writer may still map it; anything else is copied.
+// Returns the number of bytes moved, or -1.
+static int
+pipetake(struct pipe *pi, struct proc *pr, uint64 va, int left)
+{
+  uint64 pa = pi->page[pi->pghead];
+  pte_t *pte;
+  int m;
+
+  if(pi->pgoff == 0 && va % PGSIZE == 0 && left >= PGSIZE &&
+     mmaplookup(pr, va) == 0 && (pte = walk(pr->pagetable, va, 0)) != 0 &&
+     (*pte & (PTE_V|PTE_U|PTE_W|PTE_MEGA)) == (PTE_V|PTE_U|PTE_W)){
+    kfree((void*)PTE2PA(*pte));
+    *pte = PA2PTE(pa) | (PTE_FLAGS(*pte) & ~PTE_W) | PTE_COW;
+    uvmflush(pr->pagetable, va, 1);
+    m = PGSIZE;
+  } else {
+    m = PGSIZE - pi->pgoff;
+    if(m > left)
+      m = left;
+    if(m > PGSIZE - va % PGSIZE)
+      m = PGSIZE - va % PGSIZE;
+    if(copyout(pr->pagetable, va, (char*)pa + pi->pgoff, m) == -1)
+      return -1;
+    pi->pgoff += m;
+    if(pi->pgoff < PGSIZE)
+      return m;
+    kfree((void*)pa);
+  }
+  pi->pgoff = 0;
+  pi->pghead = (pi->pghead + 1) % PIPEPAGES;
+  pi->npage--;
+  wakeup(&pi->nwrite);
+  return m;
+}
+
+// Copy user data into the ring a contiguous run at a time (up
+// to the wrap or the free space), or lend whole pages to the
+// page queue when the ring is empty. Readers sleep only on an
+// empty pipe, so only the write that makes it non-empty wakes them.
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, m, empty;
+  uint off;
   struct proc *pr = myproc();
 
+  // the copies below run under pi->lock, where a fault that has
+  // to read a file could not sleep; take such faults now. a bad
+  // address is left to the copy, which stops short there.
+  if(n > 0)
+    uvmprefault(pr->pagetable, addr, n, 0);
+
   acquire(&pi->lock);
   while(i < n){
     if(pi->readopen == 0 || killed(pr)){
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
+    empty = (pi->nwrite == pi->nread && pi->npage == 0);
+    if(pi->nwrite == pi->nread && pi->npage < PIPEPAGES &&
+       pipelend(pi, pr, addr + i, n - i) == 0){
+      i += PGSIZE;
+      if(empty)
+        wakeup(&pi->nread);
+      continue;
+    }
+    // bytes may not pass queued pages.
+    if(pi->npage > 0 || pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
       sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      continue;
     }
+    off = pi->nwrite % PIPESIZE;
+    m = PIPESIZE - (pi->nwrite - pi->nread);
+    if(m > PIPESIZE - off)
+      m = PIPESIZE - off;
+    if(m > n - i)
+      m = n - i;
+    // one user page at a time, so a bad page loses no bytes
+    // that precede it.
+    if(m > PGSIZE - (addr + i) % PGSIZE)
+      m = PGSIZE - (addr + i) % PGSIZE;
+    if(copyin(pr->pagetable, pi->data + off, addr + i, m) == -1)
+      break;
+    pi->nwrite += m;
+    i += m;
+    if(empty)
+      wakeup(&pi->nread);
   }
-  wakeup(&pi->nread);
   release(&pi->lock);
 
   return i;
 }
 
+// Copy out of the ring a contiguous run at a time, waking
+// writers only when this read takes the pipe off full, or
+// take from the page queue, waking writers per page.
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, m, full;
+  uint off;
   struct proc *pr = myproc();
-  char ch;
+
+  if(n > 0)
+    uvmprefault(pr->pagetable, addr, n, 1);
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while(pi->nread == pi->nwrite && pi->npage == 0 && pi->writeopen){  //DOC: pipe-empty
     if(killed(pr)){
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  for(i = 0; i < n && (pi->nread != pi->nwrite || pi->npage > 0); i += m){  //DOC: piperead-copy
+    if(pi->npage > 0){
+      if((m = pipetake(pi, pr, addr + i, n - i)) < 0)
+        break;
+      continue;
+    }
+    off = pi->nread % PIPESIZE;
+    m = pi->nwrite - pi->nread;
+    if(m > PIPESIZE - off)
+      m = PIPESIZE - off;
+    if(m > n - i)
+      m = n - i;
+    if(m > PGSIZE - (addr + i) % PGSIZE)
+      m = PGSIZE - (addr + i) % PGSIZE;
+    if(copyout(pr->pagetable, addr + i, pi->data + off, m) == -1)
       break;
+    full = (pi->nwrite == pi->nread + PIPESIZE);
+    pi->nread += m;
+    if(full)
+      wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
   return i;
 }
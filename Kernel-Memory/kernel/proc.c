@@ -5,10 +5,25 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "slab.h"
+#include "spawn.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// Every proc structure ever allocated, newest first, linked
+// through p->allnext. Entries are never unlinked or freed, so
+// walkers need no lock; UNUSED ones are recycled by allocproc.
+// allproc_lock serializes insertion.
+struct proc *allproc;
+struct spinlock allproc_lock;
+static int nallproc;           // entries on allproc; KSTACK slots used
+
+static struct kmem_cache *proc_cache;
+
+// Live processes hashed by pid, chained through p->hnext.
+// Protected by pid_lock.
+#define NPIDHASH 64
+static struct proc *pidhash[NPIDHASH];
 
 struct proc *initproc;
 
@@ -26,36 +41,78 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
+static void
+proc_ctor(void *obj)
+{
+  struct proc *p = obj;
+
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  p->state = UNUSED;
+}
+
+// initialize the proc table.
+void
+procinit(void)
+{
+  initlock(&pid_lock, "nextpid");
+  initlock(&wait_lock, "wait_lock");
+  initlock(&allproc_lock, "allproc");
+  proc_cache = kmem_cache_create_ext("proc", sizeof(struct proc),
+                                     SLAB_HWCACHE_ALIGN, proc_ctor, 0);
+  if(proc_cache == 0)
+    panic("procinit");
+}
+
+// Allocate a page for each of the NPROC kernel stacks.
 // Map it high in memory, followed by an invalid
-// guard page.
+// guard page. Mapping them all at boot means no hart
+// can have cached a stack's PTE as invalid.
 void
 proc_mapstacks(pagetable_t kpgtbl)
 {
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
+  int i;
+
+  for(i = 0; i < NPROC; i++){
     char *pa = kalloc();
     if(pa == 0)
       panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
+    uint64 va = KSTACK(i);
     kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
   }
 }
 
-// initialize the proc table.
-void
-procinit(void)
+// Allocate a new proc structure and publish it on allproc.
+// Each proc gets the next of the KSTACK slots mapped by
+// proc_mapstacks(); like the proc itself, the stack is kept
+// for reuse, so at most NPROC procs are ever allocated.
+// Returns with p->lock held and p->state == USED, or 0.
+static struct proc*
+procalloc(void)
 {
   struct proc *p;
-  
-  initlock(&pid_lock, "nextpid");
-  initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
+
+  if((p = kmem_cache_alloc(proc_cache)) == 0)
+    return 0;
+
+  acquire(&p->lock);
+  acquire(&allproc_lock);
+  if(nallproc >= NPROC){
+    release(&allproc_lock);
+    release(&p->lock);
+    kmem_cache_free(proc_cache, p);
+    return 0;
   }
+  p->kstack = KSTACK(nallproc);
+  nallproc++;
+  p->state = USED;
+  p->allnext = allproc;
+  // lock-free walkers must see an initialized p.
+  __sync_synchronize();
+  allproc = p;
+  release(&allproc_lock);
+
+  return p;
 }
 
 // Must be called with interrupts disabled,
@@ -89,41 +146,63 @@ myproc(void)
   return p;
 }
 
-int
-allocpid()
+// Give p a fresh pid and enter it in pidhash.
+// p->lock must be held.
+static void
+allocpid(struct proc *p)
 {
-  int pid;
-  
+  struct proc **pp;
+
   acquire(&pid_lock);
-  pid = nextpid;
+  p->pid = nextpid;
   nextpid = nextpid + 1;
+  pp = &pidhash[p->pid % NPIDHASH];
+  p->hnext = *pp;
+  *pp = p;
   release(&pid_lock);
+}
 
-  return pid;
+// Remove p from pidhash. p->lock must be held.
+static void
+freepid(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&pid_lock);
+  for(pp = &pidhash[p->pid % NPIDHASH]; *pp; pp = &(*pp)->hnext){
+    if(*pp == p){
+      *pp = p->hnext;
+      break;
+    }
+  }
+  p->hnext = 0;
+  release(&pid_lock);
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
+// Look in the process table for an UNUSED proc, or allocate a
+// new one if there is none.
+// Initialize state required to run in the kernel,
 // and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// If a memory allocation fails, return 0.
 static struct proc*
 allocproc(void)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  for(p = allproc; p; p = p->allnext) {
     acquire(&p->lock);
     if(p->state == UNUSED) {
+      p->state = USED;
       goto found;
     } else {
       release(&p->lock);
     }
   }
-  return 0;
+  if((p = procalloc()) == 0)
+    return 0;
 
 found:
-  p->pid = allocpid();
-  p->state = USED;
+  allocpid(p);
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -161,13 +240,17 @@ freeproc(struct proc *p)
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  p->asid = 0;
   p->sz = 0;
+  if(p->pid)
+    freepid(p);
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->megaheap = 0;
   p->state = UNUSED;
 }
 
@@ -264,10 +347,14 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    // only reserve the address space; usertrap() and the
+    // copyin/copyout family allocate pages on first touch.
+    if(sz + n < sz || sz + n > mmapbase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
+    if(uvmdemote(p->pagetable, sz + n) < 0)
+      return -1;
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
@@ -288,8 +375,9 @@ fork(void)
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory and mappings from parent to child.
+  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0 ||
+     mmapfork(p, np) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
@@ -304,9 +392,14 @@ fork(void)
 
   // increment reference counts on open file descriptors.
   for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
+    np->ofile[i] = p->ofile[i];
+  filedup_bulk(np->ofile, NOFILE);
   np->cwd = idup(p->cwd);
+  if(p->exe)
+    np->exe = idup(p->exe);
+  memmove(np->seg, p->seg, sizeof(p->seg));
+  np->nseg = p->nseg;
+  np->megaheap = p->megaheap;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -325,6 +418,90 @@ fork(void)
   return pid;
 }
 
+// Apply one spawn() descriptor action to np's file table.
+static int
+spawnfd(struct proc *np, struct spawnact *a)
+{
+  struct file *f;
+
+  if(a->fd < 0 || a->fd >= NOFILE)
+    return -1;
+  switch(a->op){
+  case SPAWN_DUP2:
+    if(a->newfd < 0 || a->newfd >= NOFILE || (f = np->ofile[a->fd]) == 0)
+      return -1;
+    if(a->newfd == a->fd)
+      return 0;
+    if(np->ofile[a->newfd])
+      fileclose(np->ofile[a->newfd]);
+    np->ofile[a->newfd] = filedup(f);
+    return 0;
+  case SPAWN_CLOSE:
+    if(np->ofile[a->fd]){
+      fileclose(np->ofile[a->fd]);
+      np->ofile[a->fd] = 0;
+    }
+    return 0;
+  }
+  return -1;
+}
+
+// Create a child running the program at path with arguments
+// argv, building it straight from the ELF file rather than
+// copying this process's memory only for exec() to discard it.
+// The child starts with this process's open files, edited by
+// act[0..nact-1], and its working directory.
+// Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, struct spawnact *act, int nact)
+{
+  int i, pid, argc;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  // Allocate process.
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+  // np is not RUNNABLE, so no one else looks at it; and
+  // execproc() sleeps in the file system, which it could
+  // not do holding a spinlock.
+  release(&np->lock);
+
+  for(i = 0; i < NOFILE; i++)
+    np->ofile[i] = p->ofile[i];
+  filedup_bulk(np->ofile, NOFILE);
+  for(i = 0; i < nact; i++)
+    if(spawnfd(np, &act[i]) < 0)
+      goto bad;
+
+  if((argc = execproc(np, path, argv)) < 0)
+    goto bad;
+  np->trapframe->a0 = argc;
+  np->cwd = idup(p->cwd);
+
+  pid = np->pid;
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  release(&np->lock);
+
+  return pid;
+
+ bad:
+  fileclose_bulk(np->ofile, NOFILE);
+  for(i = 0; i < NOFILE; i++)
+    np->ofile[i] = 0;
+  acquire(&np->lock);
+  freeproc(np);
+  release(&np->lock);
+  return -1;
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -332,7 +509,7 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
+  for(pp = allproc; pp; pp = pp->allnext){
     if(pp->parent == p){
       pp->parent = initproc;
       wakeup(initproc);
@@ -351,19 +528,22 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and drop file mappings while the files are open.
+  mmapclear(p);
+
   // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
-  }
+  fileclose_bulk(p->ofile, NOFILE);
+  for(int fd = 0; fd < NOFILE; fd++)
+    p->ofile[fd] = 0;
 
   begin_op();
   iput(p->cwd);
+  if(p->exe)
+    iput(p->exe);
   end_op();
   p->cwd = 0;
+  p->exe = 0;
+  p->nseg = 0;
 
   acquire(&wait_lock);
 
@@ -394,12 +574,16 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout below is made under wait_lock and pp->lock.
+  if(addr != 0)
+    uvmprefault(p->pagetable, addr, sizeof(int), 1);
+
   acquire(&wait_lock);
 
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
+    for(pp = allproc; pp; pp = pp->allnext){
       if(pp->parent == p){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
@@ -455,7 +639,7 @@ scheduler(void)
     intr_on();
 
     int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
+    for(p = allproc; p; p = p->allnext) {
       acquire(&p->lock);
       if(p->state == RUNNABLE) {
         // Switch to chosen process.  It is the process's job
@@ -463,6 +647,7 @@ scheduler(void)
         // before jumping back to us.
         p->state = RUNNING;
         c->proc = p;
+        uvmmigrate(p);
         swtch(&c->context, &p->context);
 
         // Process is done running for now.
@@ -473,9 +658,12 @@ scheduler(void)
       release(&p->lock);
     }
     if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
+      // nothing to run; zero some pages for kzalloc(), then look
+      // again. once the pool is full, stop running on this core
+      // until an interrupt.
       intr_on();
-      asm volatile("wfi");
+      if(kzero_refill() == 0)
+        asm volatile("wfi");
     }
   }
 }
@@ -580,7 +768,7 @@ wakeup(void *chan)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  for(p = allproc; p; p = p->allnext) {
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
@@ -599,19 +787,27 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
+  acquire(&pid_lock);
+  for(p = pidhash[(uint)pid % NPIDHASH]; p; p = p->hnext)
+    if(p->pid == pid)
+      break;
+  release(&pid_lock);
+  if(p == 0)
+    return -1;
+
+  // p may have exited and been reused since the lookup;
+  // proc structures are never freed, so recheck under its lock.
+  acquire(&p->lock);
+  if(p->pid == pid){
+    p->killed = 1;
+    if(p->state == SLEEPING){
+      // Wake process from sleep().
+      p->state = RUNNABLE;
     }
     release(&p->lock);
+    return 0;
   }
+  release(&p->lock);
   return -1;
 }
 
@@ -682,7 +878,7 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = allproc; p; p = p->allnext){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -24,6 +24,7 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation this hart's TLB was emptied for
 };
 
 extern struct cpu cpus[NCPU];
@@ -77,10 +78,37 @@ struct trapframe {
   /* 264 */ uint64 t4;
   /* 272 */ uint64 t5;
   /* 280 */ uint64 t6;
+  /* 288 */ uint64 kernel_flush;  // no ASIDs: flush the TLB on entry and exit
 };
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A loadable ELF segment whose pages are read from the
+// executable on first access (see execfault).
+struct execseg {
+  uint64 va;                   // Start, page-aligned
+  uint64 memsz;                // Bytes in memory
+  uint64 filesz;               // Bytes backed by the file
+  uint off;                    // File offset of va
+  int perm;                    // PTE_* bits for its pages
+};
+
+#define NEXECSEG 4             // demand-paged segments per process
+
+// A file mapping made by mmap(). Its pages are read in by
+// mmapfault() on first touch; for MAP_SHARED, a page that has
+// been written holds PTE_W and is written back by munmap/msync.
+struct vma {
+  uint64 addr;                 // Start, page-aligned; 0 if unused
+  uint64 len;                  // Bytes, a multiple of PGSIZE
+  uint off;                    // File offset of addr
+  int prot;                    // PROT_* bits
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // Mapped file, holding a reference
+};
+
+#define NVMA 16                // file mappings per process
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -91,17 +119,28 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  struct proc *hnext;          // pidhash chain, under pid_lock
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
+  // set once when the proc is created.
+  struct proc *allnext;        // Next on allproc
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  uint64 asid;                 // ASID and its generation, see uvmsatp()
+  int asidcpu;                 // Hart this process last ran on
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct inode *exe;           // Executable backing seg[], or 0
+  struct execseg seg[NEXECSEG]; // Demand-paged program segments
+  int nseg;                    // Entries used in seg[]
+  int megaheap;                // Back aligned heap ranges with megapages?
+  struct vma vma[NVMA];        // File mappings, below TRAPFRAME
   char name[16];               // Process name (debugging)
 };
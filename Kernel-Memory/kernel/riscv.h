@@ -226,6 +226,9 @@ w_pmpaddr0(uint64 x)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
 
+// address-space identifier field of satp.
+#define SATP_ASID(asid) (((uint64)(asid) & 0xffff) << 44)
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void 
@@ -346,6 +349,21 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush this hart's TLB entries for one address space.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
+// flush this hart's TLB entries for one virtual address
+// in one address space.
+static inline void
+sfence_vma_page(uint64 va, uint64 asid)
+{
+  asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid));
+}
+
 typedef uint64 pte_t;
 typedef uint64 *pagetable_t; // 512 PTEs
 
@@ -357,17 +375,27 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+#define MEGAPGSIZE (PGSIZE << 9) // bytes mapped by a level-1 leaf (2 MiB)
+#define MEGAPGORDER 9            // its order for kallocpages()
+
 #define PTE_V (1L << 0) // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_COW (1L << 8) // copy-on-write (RSW bit, ignored by hardware)
+#define PTE_MEGA (1L << 9) // leaf at level 1 (RSW bit, ignored by hardware)
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
 
 #define PTE2PA(pte) (((pte) >> 10) << 12)
 
+// physical address of the 4096-byte page holding va, given the
+// leaf PTE that maps va, which may be a megapage.
+#define LEAF2PA(pte, va) (PTE2PA(pte) + \
+  (((pte) & PTE_MEGA) ? (uint64)(va) & (MEGAPGSIZE - 1) & ~(uint64)(PGSIZE - 1) : 0))
+
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
 // extract the three 9-bit page table indices from a virtual address.
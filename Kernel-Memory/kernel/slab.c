@@ -1,3 +1,54 @@
+// Slab allocator for fixed-size kernel objects.
+//
+// Each cache keeps its slabs on three lists: full, partial and free.
+// A slab is 2^order contiguous pages, aligned to its own size; the
+// struct slab header sits at the start and the objects follow it. Free
+// objects are chained through an embedded freelist (struct run), so
+// both kmem_cache_alloc() and kmem_cache_free() are O(1): alloc pops
+// from the first partial slab, free finds the slab by rounding the
+// object address down to the slab size.
+//
+// Each cache picks the smallest order whose unused tail stays within
+// SLAB_WASTE_PCT percent of the slab, so large objects pack densely.
+// Whatever tail is left is used for colouring: each new slab shifts its
+// first object by one more alignment unit, so the same object index in
+// different slabs lands in different cache sets. Caches created with
+// SLAB_HWCACHE_ALIGN also round objects to SLAB_CACHE_LINE bytes so
+// two harts never share a line between neighbouring objects.
+//
+// kmalloc()/kmfree() sit on top of a set of power-of-two caches for
+// sizes up to KMALLOC_MAX; bigger requests get whole pages. Every page
+// handed out through this file is tagged in pagemap[] so that kmfree()
+// can find the owning slab (or page run) from a bare pointer.
+//
+// Empty slabs stay cached until kalloc() runs dry; it then calls
+// kmem_cache_reap(), which flushes the magazine depots and gives back
+// every free slab beyond MP2_MIN_AVAIL_SLAB available ones per cache.
+// Before that it runs the registered shrinkers, so that subsystems
+// keeping idle objects around as a cache (the inode table) can free
+// them into their caches first.
+//
+// A cache may have a constructor, run on every object when its slab is
+// created, and a destructor, run when the slab is given back. Objects
+// are expected to be freed in their constructed state, so such caches
+// keep the freelist link in an extra word after the object (at
+// cache->offset) instead of overwriting the object's first word.
+//
+// In front of the slab lists every cache has a per-CPU pair of
+// magazines (small stacks of free objects) and a depot of full and
+// empty magazines. The common alloc/free path only pushes or pops the
+// calling hart's loaded magazine with interrupts off; cache->lock is
+// taken only to exchange magazines with the depot or to fall back to
+// the slab lists.
+//
+// A free that does reach the slab lists from a hart other than the
+// one that created the slab does not take cache->lock either: the
+// object is pushed with compare-and-swap onto the slab's remote list,
+// and the slab onto cache->remote when its remote list was empty.
+// Whoever next holds cache->lock to refill, shrink or inspect the
+// cache swaps cache->remote out with one atomic and returns the
+// objects to their freelists in a batch.
+
 #include "types.h"
 #include "param.h"
 #include "memlayout.h"
@@ -5,46 +56,929 @@
 #include "riscv.h"
 #include "defs.h"
 #include "slab.h"
+#include "slabinfo.h"
+#include "debug.h"
+
+// The cache that struct kmem_cache objects themselves come from.
+static struct kmem_cache cache_cache;
+
+// The cache that magazines come from.
+static struct kmem_cache magazine_cache;
+
+// Every cache created so far, protected by cache_list_lock.
+static struct list_head cache_list;
+static struct spinlock cache_list_lock;
+
+// Registered with kmem_register_shrinker(), at boot.
+#define NSHRINKER 4
+static void (*shrinkers[NSHRINKER])(void);
+static int nshrinker;
+
+// kmalloc size classes: kmalloc_caches[i] holds KMALLOC_MIN << i bytes.
+#define KMALLOC_NCLASS 8
+static struct kmem_cache *kmalloc_caches[KMALLOC_NCLASS];
+
+// Per physical page: 0 if not owned by this file, order+1 if part of
+// a slab of that order, or PM_LARGE|order for the first page of a
+// large kmalloc().
+#define PM_LARGE 0x80
+static uchar pagemap[NPAGES];
+
+// Bytes reserved for the slab header, before colouring.
+#define SLAB_HDR(c) ((sizeof(struct slab) + (c)->align - 1) & ~((uint64)(c)->align - 1))
+
+// Bytes in one slab of cache c.
+#define SLAB_BYTES(c) ((uint64)MP2_SLAB_SIZE << (c)->order)
+
+// Freelist link of an object, and the object of a freelist link.
+#define OBJ2RUN(c, obj) ((struct run *)((char *)(obj) + (c)->offset))
+#define RUN2OBJ(c, r) ((char *)(r) - (c)->offset)
+
+// Slab of cache c that obj lives in.
+#define OBJ2SLAB(c, obj) ((struct slab *)((uint64)(obj) & ~(SLAB_BYTES(c) - 1)))
+
+static void slab_reclaim_locked(struct kmem_cache *cache);
+
+// Acquire cache->lock, counting the acquisitions that found it taken.
+static void
+cache_lock(struct kmem_cache *cache)
+{
+  if(cache->lock.locked)
+    __sync_fetch_and_add(&cache->ncontended, 1);
+  acquire(&cache->lock);
+}
+
+// Account nalloc allocations and nfree frees to the calling hart.
+static void
+cache_count(struct kmem_cache *cache, int nalloc, int nfree)
+{
+  struct kmem_cpu_cache *cc;
+
+  push_off();
+  cc = &cache->cpu[cpuid()];
+  cc->nalloc += nalloc;
+  cc->nfree += nfree;
+  pop_off();
+}
+
+// Pick the slab order for objects of the given size: the smallest one
+// that wastes at most SLAB_WASTE_PCT percent of the slab, or else the
+// least wasteful one up to SLAB_MAX_ORDER.
+static uint
+slab_order(uint64 hdr, uint size)
+{
+  uint order, best = 0;
+  uint64 bytes, num, waste, best_waste = 0, best_bytes = 1;
+
+  for(order = 0; order <= SLAB_MAX_ORDER; order++){
+    bytes = (uint64)MP2_SLAB_SIZE << order;
+    if(bytes < hdr + size)
+      continue;
+    num = (bytes - hdr) / size;
+    waste = bytes - hdr - num * size;
+    if(waste * 100 <= bytes * SLAB_WASTE_PCT)
+      return order;
+    if(best_waste == 0 || waste * best_bytes < best_waste * bytes){
+      best = order;
+      best_waste = waste;
+      best_bytes = bytes;
+    }
+  }
+  return best;
+}
+
+static void
+cache_init(struct kmem_cache *cache, char *name, uint object_size, uint flags,
+           void (*ctor)(void *), void (*dtor)(void *))
+{
+  int i;
+
+  safestrcpy(cache->name, name, sizeof(cache->name));
+  cache->object_size = object_size;
+  cache->flags = flags;
+  cache->ctor = ctor;
+  cache->dtor = dtor;
+  initlock(&cache->lock, cache->name);
+
+  // every object must be able to hold a struct run while it is free,
+  // and stay pointer-aligned so the freelist can be walked.
+  // cache-line alignment is halved for small objects, so that
+  // several of them can still share a line.
+  cache->align = sizeof(void *);
+  if(flags & SLAB_HWCACHE_ALIGN){
+    cache->align = SLAB_CACHE_LINE;
+    while(cache->align / 2 >= object_size && cache->align / 2 >= sizeof(void *))
+      cache->align /= 2;
+  }
+  if(ctor){
+    cache->offset = (object_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    cache->size = cache->offset + sizeof(struct run);
+  } else {
+    cache->offset = 0;
+    cache->size = object_size < sizeof(struct run) ? sizeof(struct run) : object_size;
+  }
+  cache->size = (cache->size + cache->align - 1) & ~(cache->align - 1);
+  cache->order = slab_order(SLAB_HDR(cache), cache->size);
+  cache->num = (SLAB_BYTES(cache) - SLAB_HDR(cache)) / cache->size;
+  if(cache->num == 0)
+    panic("kmem_cache_create: object too large");
+
+  // spread the leftover bytes over colour_n slab colours.
+  cache->colour_off = cache->align < SLAB_CACHE_LINE ? SLAB_CACHE_LINE : cache->align;
+  cache->colour_n = (SLAB_BYTES(cache) - SLAB_HDR(cache) - cache->num * cache->size) / cache->colour_off + 1;
+  cache->colour_next = 0;
+
+  INIT_LIST_HEAD(&cache->full);
+  INIT_LIST_HEAD(&cache->partial);
+  INIT_LIST_HEAD(&cache->free);
+
+  INIT_LIST_HEAD(&cache->depot_full);
+  INIT_LIST_HEAD(&cache->depot_empty);
+  for(i = 0; i < NCPU; i++){
+    cache->cpu[i].loaded = 0;
+    cache->cpu[i].prev = 0;
+    cache->cpu[i].nalloc = 0;
+    cache->cpu[i].nfree = 0;
+  }
+  cache->ncontended = 0;
+}
+
+static void
+kmallocinit(void)
+{
+  static char names[KMALLOC_NCLASS][MP2_CACHE_MAX_NAME];
+  char *p;
+  uint size;
+  int i, n;
+
+  for(i = 0; i < KMALLOC_NCLASS; i++){
+    size = KMALLOC_MIN << i;
+    // names[i] = "kmalloc-<size>"
+    safestrcpy(names[i], "kmalloc-", sizeof(names[i]));
+    p = names[i] + strlen(names[i]);
+    for(n = size; n > 0; n /= 10)
+      p++;
+    *p = 0;
+    for(n = size; n > 0; n /= 10)
+      *--p = '0' + n % 10;
+    if((kmalloc_caches[i] = kmem_cache_create_ext(names[i], size, SLAB_HWCACHE_ALIGN, 0, 0)) == 0)
+      panic("kmallocinit");
+  }
+}
+
+void
+slabinit(void)
+{
+  initlock(&cache_list_lock, "cache_list");
+  INIT_LIST_HEAD(&cache_list);
+  cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), SLAB_NOMAG | SLAB_HWCACHE_ALIGN, 0, 0);
+  list_add_tail(&cache_cache.list, &cache_list);
+  cache_init(&magazine_cache, "kmem_magazine", sizeof(struct kmem_magazine), SLAB_NOMAG | SLAB_HWCACHE_ALIGN, 0, 0);
+  list_add_tail(&magazine_cache.list, &cache_list);
+  kmallocinit();
+}
+
+// Carve 2^order fresh pages into a slab for cache.
+// Called without cache->lock held, since kallocpages() may spin on kmem.lock.
+// Returns 0 if out of memory.
+static struct slab *
+slab_create(struct kmem_cache *cache)
+{
+  struct slab *s;
+  struct run *r;
+  uint colour;
+  int i;
+
+  if((s = (struct slab *)kallocpages(cache->order)) == 0)
+    return 0;
+
+  cache_lock(cache);
+  colour = cache->colour_next;
+  if(++cache->colour_next >= cache->colour_n)
+    cache->colour_next = 0;
+  release(&cache->lock);
+
+  s->cache = cache;
+  s->inuse = 0;
+  s->freelist = 0;
+  s->remote = 0;
+  s->rnext = 0;
+  push_off();
+  s->owner = cpuid();
+  pop_off();
+  s->s_mem = (char *)s + SLAB_HDR(cache) + colour * cache->colour_off;
+  for(i = 0; i < (1 << cache->order); i++)
+    pagemap[PA2IDX(s) + i] = cache->order + 1;
+  // thread the freelist back to front so objects are handed out in
+  // address order.
+  for(i = cache->num - 1; i >= 0; i--){
+    if(cache->ctor)
+      cache->ctor(s->s_mem + i * cache->size);
+    r = OBJ2RUN(cache, s->s_mem + i * cache->size);
+    r->next = s->freelist;
+    s->freelist = r;
+  }
+  INIT_LIST_HEAD(&s->list);
+
+  debug("[SLAB] A new slab %p (%s) is allocated\n", s, cache->name);
+  return s;
+}
+
+static void
+slab_destroy(struct slab *s)
+{
+  int i;
+
+  debug("[SLAB] Slab %p (%s) is freed\n", s, s->cache->name);
+  if(s->cache->dtor)
+    for(i = 0; i < s->cache->num; i++)
+      s->cache->dtor(s->s_mem + i * s->cache->size);
+  for(i = 0; i < (1 << s->cache->order); i++)
+    pagemap[PA2IDX(s) + i] = 0;
+  kfreepages((void *)s, s->cache->order);
+}
+
+// Is obj currently on s's freelist?
+static int
+slab_obj_free(struct slab *s, void *obj)
+{
+  struct run *r;
+
+  for(r = s->freelist; r; r = r->next)
+    if(RUN2OBJ(s->cache, r) == obj)
+      return 1;
+  return 0;
+}
+
+static void
+print_slab_list(char *title, struct list_head *head, void (*slab_obj_printer)(void *))
+{
+  struct slab *s;
+  struct kmem_cache *cache;
+  char *obj;
+  int i;
+
+  printf("[SLAB]   [ %s slabs ]\n", title);
+  list_for_each_entry(s, head, list){
+    cache = s->cache;
+    printf("[SLAB]     [ slab %p ] { freelist: %p, inuse: %d, s_mem: %p }\n", s, s->freelist, s->inuse, s->s_mem);
+    if(slab_obj_printer == 0)
+      continue;
+    for(i = 0; i < cache->num; i++){
+      obj = s->s_mem + i * cache->size;
+      if(slab_obj_free(s, obj))
+        continue;
+      printf("[SLAB]       [ idx %d ] { addr: %p, as_obj: {", i, obj);
+      slab_obj_printer(obj);
+      printf("} }\n");
+    }
+  }
+}
 
 void print_kmem_cache(struct kmem_cache *cache, void (*slab_obj_printer)(void *))
 {
-  // TODO: Implement print_kmem_cache
-  printf("[SLAB] TODO: print_kmem_cache is not yet implemented \n");
+  cache_lock(cache);
+  slab_reclaim_locked(cache);
+  printf("[SLAB] kmem_cache { name: %s, object_size: %d, at: %p, num: %d, order: %d, colours: %d }\n",
+         cache->name, cache->object_size, cache, cache->num, cache->order, cache->colour_n);
+  print_slab_list("full", &cache->full, slab_obj_printer);
+  print_slab_list("partial", &cache->partial, slab_obj_printer);
+  print_slab_list("free", &cache->free, slab_obj_printer);
+  printf("[SLAB] print_kmem_cache end\n");
+  release(&cache->lock);
 }
 
 struct kmem_cache *kmem_cache_create(char *name, uint object_size)
 {
-  // TODO: Implement kmem_cache_create
-  printf("[SLAB] TODO: kmem_cache_create is not yet implemented \n");
-  
+  return kmem_cache_create_ext(name, object_size, 0, 0, 0);
+}
+
+struct kmem_cache *kmem_cache_create_ext(char *name, uint object_size, uint flags,
+                                         void (*ctor)(void *), void (*dtor)(void *))
+{
   struct kmem_cache *cache;
-  cache = 0;
+
+  if((cache = kmem_cache_alloc(&cache_cache)) == 0)
+    return 0;
+  cache_init(cache, name, object_size, flags & ~SLAB_NOMAG, ctor, dtor);
+
+  acquire(&cache_list_lock);
+  list_add_tail(&cache->list, &cache_list);
+  release(&cache_list_lock);
+
+  debug("[SLAB] New kmem_cache (name: %s, object size: %d bytes, at: %p, max objects per slab: %d, slab pages: %d) is created\n",
+        cache->name, cache->object_size, cache, cache->num, 1 << cache->order);
   return cache;
 }
 
+// Make sure cache->partial is not empty, creating a slab if needed.
+// Called and returns with cache->lock held, but drops it while
+// allocating pages. Returns 0 if out of memory.
+static int
+slab_refill_locked(struct kmem_cache *cache)
+{
+  struct slab *s;
+
+  slab_reclaim_locked(cache);
+  if(!list_empty(&cache->partial))
+    return 1;
+  if(!list_empty(&cache->free)){
+    s = list_first_entry(&cache->free, struct slab, list);
+    list_move(&s->list, &cache->partial);
+    return 1;
+  }
+
+  release(&cache->lock);
+  s = slab_create(cache);
+  cache_lock(cache);
+  if(s == 0)
+    return 0;
+  list_add(&s->list, &cache->partial);
+  return 1;
+}
+
+// Pop one object off the first partial slab.
+// Caller must hold cache->lock and have called slab_refill_locked().
+static void *
+slab_take_locked(struct kmem_cache *cache)
+{
+  struct slab *s;
+  struct run *r;
+
+  s = list_first_entry(&cache->partial, struct slab, list);
+  r = s->freelist;
+  s->freelist = r->next;
+  s->inuse++;
+  if(s->freelist == 0)
+    list_move(&s->list, &cache->full);
+  return RUN2OBJ(cache, r);
+}
+
+// Take one object from the slab lists.
+static void *
+slab_alloc(struct kmem_cache *cache)
+{
+  void *obj = 0;
+
+  cache_lock(cache);
+  if(slab_refill_locked(cache))
+    obj = slab_take_locked(cache);
+  release(&cache->lock);
+
+  return obj;
+}
+
+// Give obj back to its slab. Caller must hold cache->lock.
+static void
+slab_free_locked(struct kmem_cache *cache, void *obj)
+{
+  struct slab *s = OBJ2SLAB(cache, obj);
+  struct run *r = OBJ2RUN(cache, obj);
+  int was_full;
+
+  if(s->inuse == 0)
+    panic("kmem_cache_free: double free");
+
+  was_full = (s->freelist == 0);
+  r->next = s->freelist;
+  s->freelist = r;
+  s->inuse--;
+
+  if(s->inuse == 0)
+    list_move(&s->list, &cache->free);
+  else if(was_full)
+    list_move(&s->list, &cache->partial);
+}
+
+// Free obj without cache->lock, from a hart that does not own its
+// slab: push it on the slab's remote list, and the slab on
+// cache->remote if it is the first such object.
+static void
+slab_free_remote(struct kmem_cache *cache, void *obj)
+{
+  struct slab *s = OBJ2SLAB(cache, obj), *head;
+  struct run *r = OBJ2RUN(cache, obj), *old;
+
+  do {
+    old = s->remote;
+    r->next = old;
+  } while(!__sync_bool_compare_and_swap(&s->remote, old, r));
+  if(old)
+    return;
+
+  do {
+    head = cache->remote;
+    s->rnext = head;
+  } while(!__sync_bool_compare_and_swap(&cache->remote, head, s));
+}
+
+// Put every remotely freed object back on its slab's freelist.
+// Caller must hold cache->lock.
+static void
+slab_reclaim_locked(struct kmem_cache *cache)
+{
+  struct slab *s, *next;
+  struct run *r, *rnext;
+
+  if(cache->remote == 0)
+    return;
+  s = __sync_lock_test_and_set(&cache->remote, 0);
+  for(; s; s = next){
+    // read the link before emptying s->remote: from then on a
+    // remote free may push s again and overwrite s->rnext.
+    next = s->rnext;
+    __sync_synchronize();
+    r = __sync_lock_test_and_set(&s->remote, 0);
+    for(; r; r = rnext){
+      rnext = r->next;
+      slab_free_locked(cache, RUN2OBJ(cache, r));
+    }
+  }
+}
+
+// Return every object in m to the slab lists and free m.
+// Caller must hold cache->lock.
+static void
+magazine_drain(struct kmem_cache *cache, struct kmem_magazine *m)
+{
+  while(m->rounds > 0)
+    slab_free_locked(cache, m->objs[--m->rounds]);
+  kmem_cache_free(&magazine_cache, m);
+}
+
+// Flush the depot and every CPU's magazines back to the slab lists.
+// The cache must not be in use on any hart.
+static void
+cache_drain(struct kmem_cache *cache)
+{
+  struct kmem_magazine *m, *tmp;
+  struct kmem_cpu_cache *cc;
+  int i;
+
+  cache_lock(cache);
+  for(i = 0; i < NCPU; i++){
+    cc = &cache->cpu[i];
+    if(cc->loaded)
+      magazine_drain(cache, cc->loaded);
+    if(cc->prev)
+      magazine_drain(cache, cc->prev);
+    cc->loaded = cc->prev = 0;
+  }
+  list_for_each_entry_safe(m, tmp, &cache->depot_full, list){
+    list_del(&m->list);
+    magazine_drain(cache, m);
+  }
+  list_for_each_entry_safe(m, tmp, &cache->depot_empty, list){
+    list_del(&m->list);
+    magazine_drain(cache, m);
+  }
+  release(&cache->lock);
+}
+
 void kmem_cache_destroy(struct kmem_cache *cache)
 {
-  // TODO: Implement kmem_cache_destroy (will not be tested)
-  printf("[SLAB] TODO: kmem_cache_destroy is not yet implemented \n");
+  struct slab *s, *tmp;
+
+  cache_drain(cache);
+
+  cache_lock(cache);
+  slab_reclaim_locked(cache);
+  if(!list_empty(&cache->full) || !list_empty(&cache->partial))
+    panic("kmem_cache_destroy: objects still in use");
+  list_for_each_entry_safe(s, tmp, &cache->free, list){
+    list_del(&s->list);
+    slab_destroy(s);
+  }
+  release(&cache->lock);
+
+  acquire(&cache_list_lock);
+  list_del(&cache->list);
+  release(&cache_list_lock);
+
+  kmem_cache_free(&cache_cache, cache);
+}
+
+static void *
+cache_alloc(struct kmem_cache *cache)
+{
+  struct kmem_cpu_cache *cc;
+  struct kmem_magazine *m;
+  void *obj;
+
+  if(cache->flags & SLAB_NOMAG)
+    return slab_alloc(cache);
+
+  push_off();
+  cc = &cache->cpu[cpuid()];
+
+  // swap in the previous magazine if the loaded one is empty.
+  if((cc->loaded == 0 || cc->loaded->rounds == 0) && cc->prev && cc->prev->rounds > 0){
+    m = cc->loaded;
+    cc->loaded = cc->prev;
+    cc->prev = m;
+  }
+
+  // both are empty: trade the previous one for a full one from the depot.
+  if(cc->loaded == 0 || cc->loaded->rounds == 0){
+    cache_lock(cache);
+    if(!list_empty(&cache->depot_full)){
+      m = list_first_entry(&cache->depot_full, struct kmem_magazine, list);
+      list_del(&m->list);
+      if(cc->prev)
+        list_add(&cc->prev->list, &cache->depot_empty);
+      cc->prev = cc->loaded;
+      cc->loaded = m;
+    }
+    release(&cache->lock);
+  }
+
+  if(cc->loaded && cc->loaded->rounds > 0){
+    obj = cc->loaded->objs[--cc->loaded->rounds];
+    pop_off();
+    return obj;
+  }
+  pop_off();
+
+  return slab_alloc(cache);
+}
+
+// Panic unless obj is an object of cache.
+static void
+obj_check(struct kmem_cache *cache, void *obj)
+{
+  struct slab *s = OBJ2SLAB(cache, obj);
+  uint64 off;
+
+  if(s->cache != cache)
+    panic("kmem_cache_free: wrong cache");
+  off = (char *)obj - s->s_mem;
+  if((char *)obj < s->s_mem || off % cache->size != 0 || off / cache->size >= cache->num)
+    panic("kmem_cache_free: bad object");
+}
+
+static void
+cache_free(struct kmem_cache *cache, void *obj)
+{
+  struct kmem_cpu_cache *cc;
+  struct kmem_magazine *m;
+  int remote;
+
+  if(cache->flags & SLAB_NOMAG)
+    goto slab;
+
+  for(;;){
+    push_off();
+    cc = &cache->cpu[cpuid()];
+
+    // swap in the previous magazine if the loaded one is full.
+    if((cc->loaded == 0 || cc->loaded->rounds == SLAB_MAG_SIZE) &&
+       cc->prev && cc->prev->rounds < SLAB_MAG_SIZE){
+      m = cc->loaded;
+      cc->loaded = cc->prev;
+      cc->prev = m;
+    }
+
+    // both are full: trade the previous one for an empty one from the depot.
+    if(cc->loaded == 0 || cc->loaded->rounds == SLAB_MAG_SIZE){
+      cache_lock(cache);
+      if(!list_empty(&cache->depot_empty)){
+        m = list_first_entry(&cache->depot_empty, struct kmem_magazine, list);
+        list_del(&m->list);
+        if(cc->prev)
+          list_add(&cc->prev->list, &cache->depot_full);
+        cc->prev = cc->loaded;
+        cc->loaded = m;
+      }
+      release(&cache->lock);
+    }
+
+    if(cc->loaded && cc->loaded->rounds < SLAB_MAG_SIZE){
+      cc->loaded->objs[cc->loaded->rounds++] = obj;
+      pop_off();
+      return;
+    }
+    pop_off();
+
+    // the depot has no empty magazine: make one and retry.
+    if((m = kmem_cache_alloc(&magazine_cache)) == 0)
+      break;
+    m->rounds = 0;
+    cache_lock(cache);
+    list_add(&m->list, &cache->depot_empty);
+    release(&cache->lock);
+  }
+
+slab:
+  // rather than take the lock for another hart's slab,
+  // leave the object on its remote list.
+  push_off();
+  remote = OBJ2SLAB(cache, obj)->owner != cpuid();
+  pop_off();
+  if(remote){
+    slab_free_remote(cache, obj);
+    return;
+  }
+  cache_lock(cache);
+  slab_free_locked(cache, obj);
+  release(&cache->lock);
 }
 
 void *kmem_cache_alloc(struct kmem_cache *cache)
 {
-  // TODO: Implement kmem_cache_alloc
-  printf("[SLAB] TODO: kmem_cache_alloc is not yet implemented \n");
-  
-  // acquire(&cache->lock); // acquire the lock before modification
-  // ... (modify kmem_cache)
-  // release(&cache->lock); // release the lock before return
-  return 0;
+  void *obj;
+
+  if((obj = cache_alloc(cache)) != 0)
+    cache_count(cache, 1, 0);
+  return obj;
 }
 
 void kmem_cache_free(struct kmem_cache *cache, void *obj)
 {
-  // TODO: Implement kmem_cache_free
-  printf("[SLAB] TODO: kmem_cache_free is not yet implemented \n");
+  obj_check(cache, obj);
+  cache_free(cache, obj);
+  cache_count(cache, 0, 1);
+}
+
+int kmem_cache_shrink(struct kmem_cache *cache)
+{
+  struct kmem_magazine *m, *tmp;
+  struct kmem_cpu_cache *cc;
+  struct slab *s, *stmp;
+  struct list_head victims;
+  struct list_head *l;
+  int avail = 0, pages = 0;
+
+  INIT_LIST_HEAD(&victims);
+
+  cache_lock(cache);
+  // objects parked in this hart's magazines and in the depot pin their
+  // slabs; return them first. other harts' magazines are left alone.
+  cc = &cache->cpu[cpuid()];
+  if(cc->loaded)
+    magazine_drain(cache, cc->loaded);
+  if(cc->prev)
+    magazine_drain(cache, cc->prev);
+  cc->loaded = cc->prev = 0;
+  list_for_each_entry_safe(m, tmp, &cache->depot_full, list){
+    list_del(&m->list);
+    magazine_drain(cache, m);
+  }
+  list_for_each_entry_safe(m, tmp, &cache->depot_empty, list){
+    list_del(&m->list);
+    magazine_drain(cache, m);
+  }
+  slab_reclaim_locked(cache);
+
+  list_for_each(l, &cache->partial)
+    avail++;
+  list_for_each(l, &cache->free)
+    avail++;
+  while(avail > MP2_MIN_AVAIL_SLAB && !list_empty(&cache->free)){
+    list_move(cache->free.next, &victims);
+    avail--;
+  }
+  release(&cache->lock);
+
+  list_for_each_entry_safe(s, stmp, &victims, list){
+    list_del(&s->list);
+    slab_destroy(s);
+    pages += 1 << cache->order;
+  }
+  return pages;
+}
+
+void kmem_register_shrinker(void (*fn)(void))
+{
+  acquire(&cache_list_lock);
+  if(nshrinker == NSHRINKER)
+    panic("kmem_register_shrinker");
+  shrinkers[nshrinker++] = fn;
+  release(&cache_list_lock);
+}
+
+int kmem_cache_reap(void)
+{
+  struct kmem_cache *cache;
+  int i, pages = 0;
+
+  // without cache_list_lock: the shrinkers free objects, which
+  // may allocate magazines and so come back here.
+  for(i = 0; i < nshrinker; i++)
+    shrinkers[i]();
+
+  acquire(&cache_list_lock);
+  list_for_each_entry(cache, &cache_list, list)
+    if(cache != &magazine_cache)
+      pages += kmem_cache_shrink(cache);
+  // last, since shrinking the others frees magazines.
+  pages += kmem_cache_shrink(&magazine_cache);
+  release(&cache_list_lock);
+
+  if(pages > 0)
+    debug("[SLAB] Reaped %d pages\n", pages);
+  return pages;
+}
+
+void *kmalloc(uint size)
+{
+  int i, order;
+  void *pa;
+
+  if(size == 0)
+    return 0;
+
+  if(size > KMALLOC_MAX){
+    for(order = 0; ((uint64)PGSIZE << order) < size; order++)
+      ;
+    if((pa = kallocpages(order)) == 0)
+      return 0;
+    pagemap[PA2IDX(pa)] = PM_LARGE | order;
+    return pa;
+  }
+
+  for(i = 0; (KMALLOC_MIN << i) < size; i++)
+    ;
+  return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+void kmfree(void *ptr)
+{
+  struct slab *s;
+  uchar pm;
+
+  if((uint64)ptr < KERNBASE || (uint64)ptr >= PHYSTOP)
+    panic("kmfree");
+  pm = pagemap[PA2IDX(ptr)];
+
+  if(pm & PM_LARGE){
+    if((uint64)ptr % PGSIZE != 0)
+      panic("kmfree: bad large object");
+    pagemap[PA2IDX(ptr)] = 0;
+    kfreepages(ptr, pm & ~PM_LARGE);
+    return;
+  }
+  if(pm == 0)
+    panic("kmfree: not allocated by kmalloc");
+
+  s = (struct slab *)((uint64)ptr & ~(((uint64)MP2_SLAB_SIZE << (pm - 1)) - 1));
+  kmem_cache_free(s->cache, ptr);
+}
+
+static void cache_free_bulk(struct kmem_cache *cache, int n, void **p);
+
+int kmem_cache_alloc_bulk(struct kmem_cache *cache, int n, void **p)
+{
+  struct kmem_cpu_cache *cc;
+  int i = 0;
+
+  // first empty this hart's magazines, without any lock.
+  if(!(cache->flags & SLAB_NOMAG)){
+    push_off();
+    cc = &cache->cpu[cpuid()];
+    while(i < n && cc->loaded && cc->loaded->rounds > 0)
+      p[i++] = cc->loaded->objs[--cc->loaded->rounds];
+    while(i < n && cc->prev && cc->prev->rounds > 0)
+      p[i++] = cc->prev->objs[--cc->prev->rounds];
+    pop_off();
+  }
+
+  // then take the rest straight off the slabs under one lock.
+  if(i < n){
+    cache_lock(cache);
+    while(i < n && slab_refill_locked(cache))
+      p[i++] = slab_take_locked(cache);
+    release(&cache->lock);
+  }
+
+  if(i < n){
+    // these were never counted as allocated.
+    cache_free_bulk(cache, i, p);
+    return 0;
+  }
+  cache_count(cache, n, 0);
+  return n;
+}
+
+// Free p[0..n-1] without touching the statistics.
+static void
+cache_free_bulk(struct kmem_cache *cache, int n, void **p)
+{
+  struct kmem_cpu_cache *cc = 0;
+  struct kmem_magazine *m;
+  int i, me, locked = 0;
+
+  push_off();
+  me = cpuid();
+  if(!(cache->flags & SLAB_NOMAG))
+    cc = &cache->cpu[me];
+  for(i = 0; i < n; i++){
+    // fill this hart's magazines first, without any lock...
+    m = 0;
+    if(cc && cc->loaded && cc->loaded->rounds < SLAB_MAG_SIZE)
+      m = cc->loaded;
+    else if(cc && cc->prev && cc->prev->rounds < SLAB_MAG_SIZE)
+      m = cc->prev;
+    if(m){
+      m->objs[m->rounds++] = p[i];
+      continue;
+    }
+    // ...then objects of other harts' slabs go on their remote
+    // lists, and the rest straight back on the slabs under one lock.
+    if(OBJ2SLAB(cache, p[i])->owner != me){
+      slab_free_remote(cache, p[i]);
+      continue;
+    }
+    if(!locked){
+      cache_lock(cache);
+      locked = 1;
+    }
+    slab_free_locked(cache, p[i]);
+  }
+  if(locked)
+    release(&cache->lock);
+  pop_off();
+}
+
+void kmem_cache_free_bulk(struct kmem_cache *cache, int n, void **p)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    obj_check(cache, p[i]);
+  cache_free_bulk(cache, n, p);
+  cache_count(cache, 0, n);
+}
+
+// Fill in *si for cache.
+static void
+cache_info(struct kmem_cache *cache, struct slabinfo *si)
+{
+  struct kmem_magazine *m;
+  struct kmem_cpu_cache *cc;
+  struct slab *s;
+  int i;
+
+  memset(si, 0, sizeof(*si));
+  safestrcpy(si->name, cache->name, sizeof(si->name));
+  si->object_size = cache->object_size;
+  si->size = cache->size;
+  si->objs_per_slab = cache->num;
+  si->pages_per_slab = 1 << cache->order;
+
+  cache_lock(cache);
+  slab_reclaim_locked(cache);
+  list_for_each_entry(s, &cache->full, list){
+    si->nr_full++;
+    si->active_objs += s->inuse;
+  }
+  list_for_each_entry(s, &cache->partial, list){
+    si->nr_partial++;
+    si->active_objs += s->inuse;
+  }
+  list_for_each_entry(s, &cache->free, list)
+    si->nr_free++;
+  si->total_objs = (si->nr_full + si->nr_partial + si->nr_free) * cache->num;
+
+  // objects parked in magazines are free, not active. other harts'
+  // rounds are read without their cooperation, so this is a snapshot.
+  list_for_each_entry(m, &cache->depot_full, list)
+    si->active_objs -= m->rounds;
+  for(i = 0; i < NCPU; i++){
+    cc = &cache->cpu[i];
+    if(cc->loaded)
+      si->active_objs -= cc->loaded->rounds;
+    if(cc->prev)
+      si->active_objs -= cc->prev->rounds;
+    si->nalloc += cc->nalloc;
+    si->nfree += cc->nfree;
+  }
+  si->ncontended = cache->ncontended;
+  release(&cache->lock);
+}
+
+int kmem_cache_count(void)
+{
+  struct kmem_cache *cache;
+  int n = 0;
+
+  acquire(&cache_list_lock);
+  list_for_each_entry(cache, &cache_list, list)
+    n++;
+  release(&cache_list_lock);
+  return n;
+}
+
+int kmem_cache_info(struct slabinfo *buf, int max)
+{
+  struct kmem_cache *cache;
+  int n = 0;
 
-  // acquire(&cache->lock); // acquire the lock before modification
-  // ... (modify kmem_cache)
-  // release(&cache->lock); // release the lock before return
+  acquire(&cache_list_lock);
+  list_for_each_entry(cache, &cache_list, list){
+    if(n == max)
+      break;
+    cache_info(cache, &buf[n++]);
+  }
+  release(&cache_list_lock);
+  return n;
 }
@@ -1,46 +1,150 @@
 #pragma once
 
+#include "param.h"
 #include "spinlock.h"
 #include "types.h"
+#include "list.h"
 
-// struct run {
-//   struct run *next;
-// };
+/**
+ * struct run - A free object inside a slab.
+ * @next: Next free object in the same slab, or 0.
+ *
+ * Free objects are threaded through their own first word, so the freelist
+ * costs no memory beyond the objects themselves. Caches with a constructor
+ * keep it in an extra word after the object instead (see kmem_cache.offset).
+ */
+struct run {
+  struct run *next;
+};
 
 /**
  * struct slab - Represents a slab in the slab allocator.
+ * @list: Link in one of the owning cache's full/partial/free lists.
  * @freelist: Linked list of free objects.
+ * @cache: The cache this slab belongs to.
+ * @inuse: Number of objects currently handed out from this slab.
+ * @s_mem: First object, after the header and this slab's colour offset.
+ * @owner: Hart that created the slab.
+ * @remote: Objects freed by other harts, not yet on @freelist.
+ * @rnext: Link in the cache's remote list while @remote is non-empty.
+ *
+ * The header lives at the start of the slab; objects follow it.
+ * @freelist and @inuse are protected by the cache lock; @remote and
+ * @rnext are updated with atomic instructions only.
  */
 struct slab
 {
-  // TODO: Choose the type of freelist from
-  //    1. void **
-  //    2. struct run *
-  // <ptr> freelist;             // Linked list of free objects
+  struct list_head list;     // Link in cache->full/partial/free
+  struct run *freelist;      // Linked list of free objects
+  struct kmem_cache *cache;  // Owning cache
+  uint inuse;                // Allocated objects in this slab
+  char *s_mem;               // First object in this slab
+  int owner;                 // Creating hart
+  struct run *remote;        // Lock-free list of remotely freed objects
+  struct slab *rnext;        // Link in cache->remote
+};
+
+// Bytes in an L1 data cache line.
+#define SLAB_CACHE_LINE 64
 
-  // TODO: Design how to link the slabs
-  // ...
+// Smallest and largest kmalloc() size classes; larger requests get pages.
+#define KMALLOC_MIN 16
+#define KMALLOC_MAX 2048
 
-  // TODO: you can add other members
-  // ...
+// Number of objects a magazine can hold.
+#define SLAB_MAG_SIZE 16
+
+/**
+ * struct kmem_magazine - A per-CPU stack of free objects.
+ * @list: Link in the cache's depot (full or empty magazine list).
+ * @rounds: Number of objects currently in @objs.
+ * @objs: The objects; objs[rounds - 1] is the top of the stack.
+ */
+struct kmem_magazine
+{
+  struct list_head list;
+  int rounds;
+  void *objs[SLAB_MAG_SIZE];
 };
 
+/**
+ * struct kmem_cpu_cache - Per-CPU front end of a kmem_cache.
+ * @loaded: Magazine that allocations and frees go to first.
+ * @prev: Previously loaded magazine, always completely full or empty.
+ *
+ * @nalloc: Objects allocated from the cache on this hart.
+ * @nfree: Objects freed to the cache on this hart.
+ *
+ * Only touched by its own hart with interrupts off, so it needs no lock.
+ * Padded to a cache line so harts do not false-share their entries.
+ */
+struct kmem_cpu_cache
+{
+  struct kmem_magazine *loaded;
+  struct kmem_magazine *prev;
+  uint64 nalloc;
+  uint64 nfree;
+} __attribute__((aligned(SLAB_CACHE_LINE)));
+
+// kmem_cache flags
+#define SLAB_NOMAG         0x1 // no per-CPU magazine layer (internal caches)
+#define SLAB_HWCACHE_ALIGN 0x2 // align objects to SLAB_CACHE_LINE
+
 /**
  * struct kmem_cache - Represents a cache of slabs.
  * @name: Cache name (e.g., "file").
  * @object_size: Size of a single object.
  * @lock: Lock for cache management.
+ * @size: Stride between two objects in a slab (object_size rounded up).
+ * @num: Number of objects that fit in one slab.
+ * @order: Each slab spans 2^order contiguous pages.
+ * @align: Alignment of every object.
+ * @colour_off: Bytes between two slab colours.
+ * @colour_n: Number of distinct colours the slab tail allows.
+ * @colour_next: Colour of the next slab to be created.
+ * @offset: Offset of the freelist link (struct run) inside an object.
+ * @ctor: Called on every object when its slab is created, or 0.
+ * @dtor: Called on every object when its slab is freed, or 0.
+ * @full: Slabs with every object allocated.
+ * @partial: Slabs with both allocated and free objects.
+ * @free: Slabs with no allocated objects.
+ * @list: Link in the global list of caches.
+ * @flags: SLAB_* flags.
+ * @depot_full: Full magazines, ready to be loaded by a CPU.
+ * @depot_empty: Empty magazines, ready to take frees from a CPU.
+ * @cpu: Per-CPU magazines, indexed by cpuid().
+ * @ncontended: Times cache->lock was found already held.
+ * @remote: Slabs with objects on their remote lists, pushed lock-free.
  */
 struct kmem_cache
 {
-  char name[32];        // Cache name (e.g., "file")
+  char name[MP2_CACHE_MAX_NAME]; // Cache name (e.g., "file")
   uint object_size;     // Size of a single object
   struct spinlock lock; // Lock for cache management
 
-  // TODO: Add slab list(s)
-  // <TYPE> full     // Completely allocated slabs (Optional)
-  // <TYPE> partial  // Partially allocated slabs
-  // <TYPE> free     // Free slabs (Optional)
+  uint size;            // Object stride inside a slab
+  uint num;             // Objects per slab
+  uint order;           // log2 of pages per slab
+  uint align;           // Object alignment
+  uint colour_off;      // Colour step in bytes
+  uint colour_n;        // Number of colours
+  uint colour_next;     // Next colour to use, under lock
+  uint offset;          // Freelist link offset in an object
+  void (*ctor)(void *); // Object constructor
+  void (*dtor)(void *); // Object destructor
+
+  struct list_head full;    // Completely allocated slabs
+  struct list_head partial; // Partially allocated slabs
+  struct list_head free;    // Free slabs
+
+  struct list_head list;    // Link in the global cache list
+  uint flags;               // SLAB_* flags
+
+  struct list_head depot_full;  // Magazine depot, under lock
+  struct list_head depot_empty;
+  struct kmem_cpu_cache cpu[NCPU]; // Per-CPU magazines
+  uint64 ncontended;        // Contended lock acquisitions
+  struct slab *remote;      // Slabs with remote frees, lock-free
 };
 
 /**
@@ -52,6 +156,23 @@ struct kmem_cache
  */
 struct kmem_cache *kmem_cache_create(char *name, uint object_size);
 
+/**
+ * kmem_cache_create_ext - Create a new slab cache with flags and callbacks.
+ * @name: The name of the cache.
+ * @object_size: The size of each object in the cache.
+ * @flags: SLAB_HWCACHE_ALIGN to place objects on cache-line boundaries.
+ * @ctor: Constructor run once per object when its slab is populated, or 0.
+ * @dtor: Destructor run once per object when its slab is freed, or 0.
+ *
+ * Objects of a cache with @ctor must be passed to kmem_cache_free() in
+ * their constructed state; kmem_cache_alloc() returns them as they were
+ * freed, without running @ctor again.
+ *
+ * Return: A pointer to the new cache.
+ */
+struct kmem_cache *kmem_cache_create_ext(char *name, uint object_size, uint flags,
+                                         void (*ctor)(void *), void (*dtor)(void *));
+
 /**
  * kmem_cache_destroy - Destroy a slab cache.
  * @cache: The cache to be destroyed.
@@ -73,9 +194,98 @@ void *kmem_cache_alloc(struct kmem_cache *cache);
  */
 void kmem_cache_free(struct kmem_cache *cache, void *obj);
 
+/**
+ * kmem_cache_alloc_bulk - Allocate several objects from a slab cache.
+ * @cache: The cache to allocate from.
+ * @n: Number of objects wanted.
+ * @p: Array that receives the @n objects.
+ *
+ * Empties the calling hart's magazines first, then takes the remainder
+ * from the slabs under a single acquisition of cache->lock.
+ *
+ * Return: @n on success, or 0 (with nothing allocated) if out of memory.
+ */
+int kmem_cache_alloc_bulk(struct kmem_cache *cache, int n, void **p);
+
+/**
+ * kmem_cache_free_bulk - Free several objects back to a slab cache.
+ * @cache: The cache to free to.
+ * @n: Number of objects in @p.
+ * @p: The objects to free.
+ *
+ * Fills the calling hart's magazines first. Of the remainder, objects
+ * of slabs created by other harts go on those slabs' remote lists, and
+ * the rest return to the slabs under a single acquisition of
+ * cache->lock.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *cache, int n, void **p);
+
+/**
+ * kmem_cache_shrink - Release a cache's surplus empty slabs.
+ * @cache: The cache to shrink.
+ *
+ * Flushes the magazine depot and the calling hart's magazines back into
+ * the slabs, then frees empty slabs while more than MP2_MIN_AVAIL_SLAB
+ * partial/free slabs remain.
+ *
+ * Return: Number of pages given back to kalloc().
+ */
+int kmem_cache_shrink(struct kmem_cache *cache);
+
 /**
  * print_kmem_cache - Print the details of a kmem_cache.
  * @cache: The cache to print.
  * @print_fn: Function to print each object in the cache. If NULL (0) is given, will skip object printing part.
  */
 void print_kmem_cache(struct kmem_cache *cache, void (*print_fn)(void *));
+
+/**
+ * kmem_register_shrinker - Have kmem_cache_reap() call back a cache's user.
+ * @fn: Called at the start of every reap, before the caches are shrunk and
+ *      without the allocator's locks held. It should free the objects its
+ *      user keeps only to avoid re-creating them, so that their slabs can
+ *      be given back.
+ *
+ * Meant to be called at boot; there is room for only a few shrinkers.
+ */
+void kmem_register_shrinker(void (*fn)(void));
+
+/**
+ * kmem_cache_count - Count the caches in existence.
+ *
+ * Return: The number of caches, including the allocator's own.
+ */
+int kmem_cache_count(void);
+
+struct slabinfo;
+
+/**
+ * kmem_cache_info - Snapshot the statistics of every cache.
+ * @buf: Array that receives one struct slabinfo per cache.
+ * @max: Number of entries @buf has room for.
+ *
+ * Remotely freed objects are reclaimed first. Objects parked in other
+ * harts' magazines are read without their cooperation, so the counts
+ * are a snapshot rather than exact.
+ *
+ * Return: The number of entries filled in.
+ */
+int kmem_cache_info(struct slabinfo *buf, int max);
+
+/**
+ * kmalloc - Allocate a block of kernel memory.
+ * @size: Number of bytes needed.
+ *
+ * Sizes up to KMALLOC_MAX come from the power-of-two kmalloc-* caches and
+ * are aligned to min(size class, SLAB_CACHE_LINE); larger sizes get
+ * 2^order contiguous pages. The memory is not zeroed.
+ *
+ * Return: A pointer to the block, or 0 if out of memory or @size is 0.
+ */
+void *kmalloc(uint size);
+
+/**
+ * kmfree - Free a block returned by kmalloc().
+ * @ptr: The block to free.
+ */
+void kmfree(void *ptr);
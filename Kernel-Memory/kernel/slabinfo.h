@@ -0,0 +1,34 @@
+// Per-cache statistics returned by the slabinfo() system call.
+struct slabinfo {
+  char name[32];        // Cache name
+  uint object_size;     // Requested object size
+  uint size;            // Object stride inside a slab
+  uint objs_per_slab;   // Objects per slab
+  uint pages_per_slab;  // Pages per slab
+  uint active_objs;     // Objects handed out (not in a magazine)
+  uint total_objs;      // Objects in all slabs of the cache
+  uint nr_full;         // Slabs with every object allocated
+  uint nr_partial;      // Slabs with some objects allocated
+  uint nr_free;         // Slabs with no objects allocated
+  uint64 nalloc;        // kmem_cache_alloc()s so far
+  uint64 nfree;         // kmem_cache_free()s so far
+  uint64 ncontended;    // cache->lock acquisitions that had to spin
+};
+
+// slabbench() access patterns.
+#define SB_LIFO    0    // free a batch newest first
+#define SB_FIFO    1    // free a batch oldest first
+#define SB_RANDOM  2    // random alloc/free over a window of batch objects
+#define SB_REMOTE  3    // free objects handed off by other callers
+#define SB_KALLOC  4    // kalloc()/kfree() pages, LIFO, as a baseline
+#define SB_NPATTERN 5
+
+// Argument and result of the slabbench() system call.
+struct slabbench {
+  int pattern;          // SB_*
+  uint size;            // Object size, 1..4096 (ignored for SB_KALLOC)
+  uint n;               // Alloc/free pairs to run
+  uint batch;           // Objects live at once, 1..64
+  uint64 ns;            // Out: elapsed time
+  int cpu;              // Out: hart the run started on
+};
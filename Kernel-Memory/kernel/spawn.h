@@ -0,0 +1,14 @@
+// File-descriptor actions for spawn(), applied in order to the
+// child's copy of the parent's descriptor table. A list ends
+// with an entry whose op is SPAWN_END.
+#define SPAWN_END   0
+#define SPAWN_DUP2  1  // make newfd refer to fd's open file
+#define SPAWN_CLOSE 2  // close fd
+
+#define MAXSPAWNACT 16 // max actions per spawn()
+
+struct spawnact {
+  int op;
+  int fd;
+  int newfd;
+};
@@ -102,6 +102,13 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_slabinfo(void);
+extern uint64 sys_slabbench(void);
+extern uint64 sys_megaheap(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_msync(void);
+extern uint64 sys_spawn(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -128,6 +135,13 @@ static uint64 (*syscalls[])(void) = {
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
 [SYS_debugswitch]  sys_debugswitch,
+[SYS_slabinfo]     sys_slabinfo,
+[SYS_slabbench]    sys_slabbench,
+[SYS_megaheap]     sys_megaheap,
+[SYS_mmap]         sys_mmap,
+[SYS_munmap]       sys_munmap,
+[SYS_msync]        sys_msync,
+[SYS_spawn]        sys_spawn,
 };
 
 void
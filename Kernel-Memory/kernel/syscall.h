@@ -23,3 +23,10 @@
 
 /* MP2 */
 #define SYS_debugswitch 22 // switch debug mode
+#define SYS_slabinfo    23 // per-cache slab statistics
+#define SYS_slabbench   24 // slab allocator microbenchmark
+#define SYS_megaheap    25 // opt in to megapage-backed heap
+#define SYS_mmap        26 // map a file into memory
+#define SYS_munmap      27 // remove a file mapping
+#define SYS_msync       28 // write a shared mapping back
+#define SYS_spawn       29 // start a program in a new child
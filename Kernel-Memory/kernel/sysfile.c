@@ -15,6 +15,8 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "memlayout.h"
+#include "spawn.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -431,24 +433,21 @@ sys_chdir(void)
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Copy the user's argv array at uargv into argv[MAXARG], one
+// kalloc'd page per string; the caller frees them with freeargv.
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
-      goto bad;
+    if(i >= MAXARG){
+      return -1;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
-      goto bad;
+      return -1;
     }
     if(uarg == 0){
       argv[i] = 0;
@@ -456,22 +455,67 @@ sys_exec(void)
     }
     argv[i] = kalloc();
     if(argv[i] == 0)
-      goto bad;
+      return -1;
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
-      goto bad;
+      return -1;
   }
+  return 0;
+}
 
-  int ret = exec(path, argv);
+static void
+freeargv(char **argv)
+{
+  int i;
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
+  for(i = 0; i < MAXARG && argv[i] != 0; i++)
     kfree(argv[i]);
+}
 
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+  int ret = -1;
+
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(fetchargv(uargv, argv) == 0)
+    ret = exec(path, argv);
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+// spawn(path, argv, act)
+// Start path as a new child process; act is an array of
+// struct spawnact ending with SPAWN_END, or 0 for none.
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  struct spawnact act[MAXSPAWNACT];
+  uint64 uargv, uact;
+  int nact = 0, ret = -1;
+
+  argaddr(1, &uargv);
+  argaddr(2, &uact);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  for(; uact != 0; nact++){
+    if(nact >= MAXSPAWNACT)
+      return -1;
+    if(copyin(myproc()->pagetable, (char*)&act[nact],
+              uact + nact*sizeof(act[0]), sizeof(act[0])) < 0)
+      return -1;
+    if(act[nact].op == SPAWN_END)
+      break;
+  }
+  if(fetchargv(uargv, argv) == 0)
+    ret = spawn(path, argv, act, nact);
+  freeargv(argv);
+  return ret;
 }
 
 uint64
@@ -503,3 +547,308 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Return the mapping of p that contains va, or 0.
+struct vma*
+mmaplookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->addr != 0 && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// Lowest address used by a mapping of p, or TRAPFRAME if none.
+// The heap may grow up to here; new mappings go just below it.
+uint64
+mmapbase(struct proc *p)
+{
+  uint64 base = TRAPFRAME;
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->addr != 0 && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+// Handle a user fault on page va of mapping v; pte is its
+// current leaf, if any. An unmapped page is read in from the
+// file. A present, read-only page of a writable MAP_SHARED
+// mapping is being written for the first time since it was
+// last written back: grant PTE_W, which marks it dirty.
+int
+mmapfault(struct proc *p, struct vma *v, uint64 va, pte_t *pte)
+{
+  struct inode *ip = v->f->ip;
+  int perm = PTE_U;
+  char *mem;
+  int r;
+
+  va = PGROUNDDOWN(va);
+  if(pte != 0 && (*pte & PTE_V)){
+    if((v->flags & MAP_SHARED) == 0 || (v->prot & PROT_WRITE) == 0 ||
+       (*pte & PTE_W))
+      return -1;
+    *pte |= PTE_W;
+    uvmflush(p->pagetable, va, 1);
+    return 0;
+  }
+
+  if(v->prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;
+  if((v->prot & PROT_WRITE) && (v->flags & MAP_PRIVATE))
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  if((perm & (PTE_R|PTE_X)) == 0)
+    return -1;
+
+  if((mem = kzalloc()) == 0)
+    return -1;
+  // as in execfault(), ilock() may sleep.
+  if(holdingany())
+    goto bad;
+  ilock(ip);
+  r = readi(ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE);
+  iunlock(ip);
+  if(r < 0)
+    goto bad;
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0)
+    goto bad;
+  return 0;
+
+ bad:
+  kfree(mem);
+  return -1;
+}
+
+// Write page va of mapping v, at physical address pa, back to
+// the file. Like filewrite(), go a few blocks per transaction so
+// as not to exceed the log; never write past the end of the file.
+static int
+mmapflush(struct vma *v, uint64 va, uint64 pa)
+{
+  struct inode *ip = v->f->ip;
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint off = v->off + (va - v->addr);
+  int i, n, r;
+
+  for(i = 0; i < PGSIZE; i += n){
+    n = PGSIZE - i;
+    if(n > max)
+      n = max;
+    begin_op();
+    ilock(ip);
+    if(off + i >= ip->size)
+      n = 0;
+    else if(n > ip->size - (off + i))
+      n = ip->size - (off + i);
+    r = n > 0 ? writei(ip, 0, pa + i, off + i, n) : 0;
+    iunlock(ip);
+    end_op();
+    if(r != n)
+      return -1;
+    if(n == 0)
+      break;
+  }
+  return 0;
+}
+
+// Write back the dirty pages of MAP_SHARED mapping v in
+// [va, va+len) and make them clean (read-only) again.
+// Returns -1 if any page could not be written.
+static int
+mmapwriteback(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  uint64 a;
+  pte_t *pte;
+  int r = 0;
+
+  if((v->flags & MAP_SHARED) == 0)
+    return 0;
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) == 0){
+      a = walkskip(p->pagetable, a) - PGSIZE;
+      continue;
+    }
+    if((*pte & PTE_V) == 0 || (*pte & PTE_W) == 0)
+      continue;
+    if(mmapflush(v, a, PTE2PA(*pte)) < 0)
+      r = -1;
+    *pte &= ~PTE_W;
+  }
+  uvmflush(p->pagetable, va, len / PGSIZE);
+  return r;
+}
+
+// Remove all of p's mappings, writing back dirty shared pages.
+// Called by exit() and by exec() before it replaces the image.
+void
+mmapclear(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->addr == 0)
+      continue;
+    mmapwriteback(p, v, v->addr, v->len);
+    uvmunmap(p->pagetable, v->addr, v->len / PGSIZE, 1);
+    fileclose(v->f);
+    v->addr = 0;
+    v->f = 0;
+  }
+}
+
+// Give np, being forked from p, copies of p's mappings. The
+// child shares the pages p has resident: copy-on-write for
+// MAP_PRIVATE mappings, the same pages for MAP_SHARED ones.
+// Returns 0, or -1 with np left without mappings.
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    if(v->addr == 0)
+      continue;
+    if(uvmcopyrange(p->pagetable, np->pagetable, v->addr,
+                    v->addr + v->len, v->flags & MAP_SHARED) < 0)
+      goto bad;
+    *nv = *v;
+    filedup(nv->f);
+  }
+  return 0;
+
+ bad:
+  for(nv = np->vma; nv < &np->vma[NVMA]; nv++){
+    if(nv->addr == 0)
+      continue;
+    uvmunmap(np->pagetable, nv->addr, nv->len / PGSIZE, 1);
+    fileclose(nv->f);
+    nv->addr = 0;
+    nv->f = 0;
+  }
+  return -1;
+}
+
+// mmap(fd, off, len, prot, flags)
+// Map len bytes of the file from page-aligned offset off.
+// Returns the address of the mapping, or -1.
+uint64
+sys_mmap(void)
+{
+  struct file *f;
+  struct proc *p = myproc();
+  struct vma *v, *nv = 0;
+  uint64 off, len, base;
+  int prot, flags;
+
+  argaddr(1, &off);
+  argaddr(2, &len);
+  argint(3, &prot);
+  argint(4, &flags);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if((prot & PROT_WRITE) && flags == MAP_SHARED && !f->writable)
+    return -1;
+  if(len == 0 || len > MAXVA || off % PGSIZE != 0 ||
+     off + len > (uint64)MAXFILE*BSIZE)
+    return -1;
+  len = PGROUNDUP(len);
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->addr == 0){
+      nv = v;
+      break;
+    }
+  }
+  base = mmapbase(p);
+  if(nv == 0 || len > base - PGROUNDUP(p->sz))
+    return -1;
+
+  nv->addr = base - len;
+  nv->len = len;
+  nv->off = off;
+  nv->prot = prot;
+  nv->flags = flags;
+  nv->f = filedup(f);
+  return nv->addr;
+}
+
+// munmap(addr, len)
+// Unmap part or all of one mapping, writing back dirty
+// MAP_SHARED pages first.
+uint64
+sys_munmap(void)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv = 0;
+  uint64 addr, len;
+  int r;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  if(addr % PGSIZE != 0 || len == 0 || len > MAXVA ||
+     (v = mmaplookup(p, addr)) == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if(len > v->addr + v->len - addr)
+    return -1;
+  if(addr != v->addr && addr + len != v->addr + v->len){
+    // a hole in the middle splits the mapping in two.
+    for(nv = p->vma; nv < &p->vma[NVMA]; nv++)
+      if(nv->addr == 0)
+        break;
+    if(nv == &p->vma[NVMA])
+      return -1;
+  }
+
+  r = mmapwriteback(p, v, addr, len);
+  uvmunmap(p->pagetable, addr, len / PGSIZE, 1);
+
+  if(addr == v->addr && len == v->len){
+    fileclose(v->f);
+    v->addr = 0;
+    v->f = 0;
+  } else if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+    v->len -= len;
+  } else if(addr + len == v->addr + v->len){
+    v->len -= len;
+  } else {
+    *nv = *v;
+    nv->addr = addr + len;
+    nv->off = v->off + (nv->addr - v->addr);
+    nv->len = v->addr + v->len - nv->addr;
+    filedup(nv->f);
+    v->len = addr - v->addr;
+  }
+  return r;
+}
+
+// msync(addr, len)
+// Write dirty pages of a MAP_SHARED mapping back to the file.
+uint64
+sys_msync(void)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  if(addr % PGSIZE != 0 || len > MAXVA || (v = mmaplookup(p, addr)) == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if(len > v->addr + v->len - addr)
+    return -1;
+  return mmapwriteback(p, v, addr, len);
+}
@@ -5,6 +5,8 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "slab.h"
+#include "slabinfo.h"
 
 uint64
 sys_exit(void)
@@ -91,3 +93,266 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// slabinfo(struct slabinfo *buf, int max)
+// Copy statistics for up to max caches to buf.
+// Returns the number of entries copied, or -1.
+uint64
+sys_slabinfo(void)
+{
+  struct slabinfo *buf;
+  uint64 addr;
+  int max, n;
+
+  argaddr(0, &addr);
+  argint(1, &max);
+  if(max <= 0)
+    return 0;
+
+  if((n = kmem_cache_count()) > max)
+    n = max;
+  if((buf = kmalloc(n * sizeof(struct slabinfo))) == 0)
+    return -1;
+  n = kmem_cache_info(buf, n);
+
+  if(copyout(myproc()->pagetable, addr, (char *)buf, n * sizeof(struct slabinfo)) < 0)
+    n = -1;
+  kmfree(buf);
+  return n;
+}
+
+// slabbench() caches, one per object size, created on first use and
+// kept. Each has a ring of objects handed off between SB_REMOTE runs.
+#define NBENCH      4
+#define BENCH_XFER  256
+#define BENCH_BATCH 64
+static struct spinlock bench_lock;
+static struct bench {
+  uint size;
+  struct kmem_cache *cache;
+  void *xfer[BENCH_XFER];
+  int head, count;
+} benches[NBENCH];
+
+// Set up the slabbench() state.
+void
+slabbenchinit(void)
+{
+  initlock(&bench_lock, "slabbench");
+}
+
+// r_time() ticks per second on qemu -machine virt.
+#define TIMEBASE_HZ 10000000
+
+// Find the benchmark for size-byte objects under bench_lock.
+// Returns it, or 0 with *slot set to a free entry (or 0 if none).
+static struct bench *
+bench_lookup(uint size, struct bench **slot)
+{
+  struct bench *b;
+
+  *slot = 0;
+  for(b = benches; b < &benches[NBENCH]; b++){
+    if(b->cache && b->size == size)
+      return b;
+    if(b->cache == 0 && *slot == 0)
+      *slot = b;
+  }
+  return 0;
+}
+
+// Find or create the benchmark cache for objects of size bytes,
+// named "slabbench-<size>" so that slabtop can tell them apart.
+static struct bench *
+bench_get(uint size)
+{
+  char name[MP2_CACHE_MAX_NAME], *p;
+  struct kmem_cache *cache;
+  struct bench *b, *slot;
+  uint n;
+
+  acquire(&bench_lock);
+  b = bench_lookup(size, &slot);
+  release(&bench_lock);
+  if(b || slot == 0)
+    return b;
+
+  // create the cache without bench_lock, since that may allocate.
+  safestrcpy(name, "slabbench-", sizeof(name));
+  p = name + strlen(name);
+  for(n = size; n > 0; n /= 10)
+    p++;
+  *p = 0;
+  for(n = size; n > 0; n /= 10)
+    *--p = '0' + n % 10;
+  if((cache = kmem_cache_create(name, size)) == 0)
+    return 0;
+
+  // someone else may have set it up meanwhile.
+  acquire(&bench_lock);
+  if((b = bench_lookup(size, &slot)) == 0 && slot != 0){
+    slot->size = size;
+    slot->cache = cache;
+    b = slot;
+    cache = 0;
+  }
+  release(&bench_lock);
+  if(cache)
+    kmem_cache_destroy(cache);
+  return b;
+}
+
+// Put up to k of p[] on b's hand-off ring, and take up to k objects
+// back off it into q[], oldest first. Returns the number taken; the
+// objects of p[] that did not fit are moved to the front of p[] and
+// their number stored in *left.
+static int
+bench_swap(struct bench *b, void **p, int k, void **q, int *left)
+{
+  int i, j, n = 0;
+
+  acquire(&bench_lock);
+  for(i = 0; i < k && b->count < BENCH_XFER; i++)
+    b->xfer[(b->head + b->count++) % BENCH_XFER] = p[i];
+  for(j = 0; i < k; )
+    p[j++] = p[i++];
+  *left = j;
+  while(n < k && b->count > 0){
+    q[n++] = b->xfer[b->head];
+    b->head = (b->head + 1) % BENCH_XFER;
+    b->count--;
+  }
+  release(&bench_lock);
+  return n;
+}
+
+// Run sb->n alloc/free pairs in pattern sb->pattern.
+// Returns elapsed r_time() ticks, or -1 if out of memory.
+static uint64
+bench_run(struct slabbench *sb, struct bench *b)
+{
+  void *p[BENCH_BATCH], *q[BENCH_BATCH];
+  uint64 t0, t1, rnd, done = 0;
+  int i, k, n, left;
+
+  t0 = r_time();
+  rnd = t0 | 1;
+  if(sb->pattern == SB_RANDOM){
+    memset(p, 0, sizeof(p));
+    while(done < sb->n){
+      rnd ^= rnd << 13;
+      rnd ^= rnd >> 7;
+      rnd ^= rnd << 17;
+      i = rnd % sb->batch;
+      if(p[i]){
+        kmem_cache_free(b->cache, p[i]);
+        p[i] = 0;
+        done++;
+      } else if((p[i] = kmem_cache_alloc(b->cache)) == 0)
+        break;
+    }
+    t1 = r_time();
+    for(i = 0; i < sb->batch; i++)
+      if(p[i])
+        kmem_cache_free(b->cache, p[i]);
+    return done < sb->n ? -1 : t1 - t0;
+  }
+
+  while(done < sb->n){
+    k = sb->n - done < sb->batch ? sb->n - done : sb->batch;
+    for(i = 0; i < k; i++){
+      p[i] = sb->pattern == SB_KALLOC ? kalloc() : kmem_cache_alloc(b->cache);
+      if(p[i] == 0)
+        goto oom;
+    }
+    switch(sb->pattern){
+    case SB_LIFO:
+      for(i = k - 1; i >= 0; i--)
+        kmem_cache_free(b->cache, p[i]);
+      break;
+    case SB_FIFO:
+      for(i = 0; i < k; i++)
+        kmem_cache_free(b->cache, p[i]);
+      break;
+    case SB_REMOTE:
+      n = bench_swap(b, p, k, q, &left);
+      for(i = 0; i < n; i++)
+        kmem_cache_free(b->cache, q[i]);
+      for(i = 0; i < left; i++)
+        kmem_cache_free(b->cache, p[i]);
+      break;
+    case SB_KALLOC:
+      for(i = k - 1; i >= 0; i--)
+        kfree(p[i]);
+      break;
+    }
+    done += k;
+  }
+  t1 = r_time();
+
+  // objects still on the ring were allocated by this or another run;
+  // whoever finishes first frees them, untimed.
+  if(sb->pattern == SB_REMOTE){
+    while((n = bench_swap(b, p, 0, q, &left)) > 0)
+      for(i = 0; i < n; i++)
+        kmem_cache_free(b->cache, q[i]);
+  }
+  return t1 - t0;
+
+oom:
+  while(--i >= 0){
+    if(sb->pattern == SB_KALLOC)
+      kfree(p[i]);
+    else
+      kmem_cache_free(b->cache, p[i]);
+  }
+  return -1;
+}
+
+// slabbench(struct slabbench *sb)
+// Time sb->n alloc/free pairs on the calling hart and store the
+// elapsed nanoseconds in sb->ns. Returns 0, or -1.
+uint64
+sys_slabbench(void)
+{
+  struct slabbench sb;
+  struct bench *b = 0;
+  uint64 addr, ticks;
+  struct proc *p = myproc();
+
+  argaddr(0, &addr);
+  if(copyin(p->pagetable, (char *)&sb, addr, sizeof(sb)) < 0)
+    return -1;
+  if(sb.pattern < 0 || sb.pattern >= SB_NPATTERN || sb.batch < 1 || sb.batch > BENCH_BATCH)
+    return -1;
+  if(sb.pattern != SB_KALLOC){
+    if(sb.size < 1 || sb.size > PGSIZE)
+      return -1;
+    if((b = bench_get(sb.size)) == 0)
+      return -1;
+  }
+
+  push_off();
+  sb.cpu = cpuid();
+  pop_off();
+  if((ticks = bench_run(&sb, b)) == -1)
+    return -1;
+  sb.ns = ticks * (1000000000 / TIMEBASE_HZ);
+
+  if(copyout(p->pagetable, addr, (char *)&sb, sizeof(sb)) < 0)
+    return -1;
+  return 0;
+}
+
+// megaheap(int on)
+// Ask for heap pages to be backed by 2 MiB megapages wherever a
+// whole aligned megapage of the heap is reserved and untouched.
+uint64
+sys_megaheap(void)
+{
+  int on;
+
+  argint(0, &on);
+  myproc()->megaheap = (on != 0);
+  return 0;
+}
@@ -67,6 +67,11 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 15 && uvmcow(p->pagetable, r_stval()) == 0){
+    // store to a copy-on-write page; now it has its own copy.
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            uvmlazy(p->pagetable, r_stval()) == 0){
+    // first touch of a program or heap page.
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -120,7 +125,7 @@ usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = uvmsatp(p);
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
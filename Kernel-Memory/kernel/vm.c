@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -15,6 +17,17 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// Address-space identifiers. The kernel page table is ASID 0;
+// processes get theirs in order within a generation. When they
+// run out a new generation begins, and each hart empties its TLB
+// before it first runs a process of the new generation, so no
+// hart can mistake a reused ASID's entries for its new owner's.
+static struct spinlock asid_lock;
+static uint64 asidgen = 1;     // current generation; read without the lock
+static uint64 asidnext = 1;    // next unused ASID in this generation
+static uint64 nasid = 1;       // ASIDs the hardware implements
+#define ASIDSHIFT 16           // p->asid holds generation << ASIDSHIFT | ASID
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -45,7 +58,7 @@ kvmmake(void)
 
   // allocate and map a kernel stack for each process.
   proc_mapstacks(kpgtbl);
-  
+
   return kpgtbl;
 }
 
@@ -54,6 +67,7 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  initlock(&asid_lock, "asid");
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -64,12 +78,91 @@ kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
+  // the ASID field keeps only the bits the hart implements.
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(~0L));
+  nasid = ((r_satp() >> 44) & 0xffff) + 1;
   w_satp(MAKE_SATP(kernel_pagetable));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Return the satp value that runs p's page table on this hart,
+// giving p an ASID if it has none in the current generation.
+// Called with interrupts off on the way out to user space.
+// Without hardware ASIDs (nasid == 1) user and kernel share
+// ASID 0, so the trampoline flushes the whole TLB on every
+// entry and exit instead, as it did before ASIDs.
+uint64
+uvmsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 gen;
+
+  p->trapframe->kernel_flush = (nasid == 1);
+  if(nasid == 1)
+    return MAKE_SATP(p->pagetable);
+
+  // the common case, p's ASID still current, needs no lock.
+  // a rollover racing with this is harmless: no hart runs the
+  // new generation before emptying its TLB, below.
+  gen = __atomic_load_n(&asidgen, __ATOMIC_ACQUIRE);
+  if((p->asid >> ASIDSHIFT) != gen){
+    acquire(&asid_lock);
+    if((p->asid >> ASIDSHIFT) != asidgen){
+      if(asidnext >= nasid){
+        __atomic_store_n(&asidgen, asidgen + 1, __ATOMIC_RELEASE);
+        asidnext = 1;
+      }
+      p->asid = (asidgen << ASIDSHIFT) | asidnext++;
+    }
+    gen = asidgen;
+    release(&asid_lock);
+  }
+
+  if(c->asidgen != gen){
+    sfence_vma();
+    c->asidgen = gen;
+  }
+  return MAKE_SATP(p->pagetable) | SATP_ASID(p->asid);
+}
+
+// p is about to run on this hart. If it last ran elsewhere, this
+// hart may still hold entries for p's ASID from before changes
+// made (and flushed) on other harts; drop them.
+void
+uvmmigrate(struct proc *p)
+{
+  if(p->asidcpu == cpuid())
+    return;
+  if(p->asid != 0)
+    sfence_vma_asid(p->asid & ((1L << ASIDSHIFT) - 1));
+  p->asidcpu = cpuid();
+}
+
+// The PTEs of npages pages from va on in pagetable have changed;
+// drop this hart's TLB entries for them. Only the current process
+// can have such entries here that uvmsatp() and uvmmigrate() will
+// not drop before it next runs, and only under its own ASID; a
+// page table not in use needs no flush at all. Without hardware
+// ASIDs p->asid stays 0 and the trampoline flushes instead.
+void
+uvmflush(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  struct proc *p = myproc();
+  uint64 asid;
+
+  if(p == 0 || p->pagetable != pagetable || p->asid == 0)
+    return;
+  asid = p->asid & ((1L << ASIDSHIFT) - 1);
+  if(npages > 16){
+    sfence_vma_asid(asid);
+    return;
+  }
+  for(; npages > 0; npages--, va += PGSIZE)
+    sfence_vma_page(va, asid);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -82,6 +175,9 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va lies in a megapage, returns its level-1 leaf PTE,
+// marked PTE_MEGA; see LEAF2PA().
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -91,17 +187,35 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(*pte & PTE_MEGA)
+        return pte;    // va lies in a megapage.
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// walk(pagetable, va, 0) found no page-table page for va.
+// Return the first address past the hole: the next 1 GiB
+// boundary if the level-2 entry is empty too, else the next
+// 2 MiB boundary. Lets loops over a sparse [0, sz) skip
+// unmapped spans instead of walking them page by page.
+uint64
+walkskip(pagetable_t pagetable, uint64 va)
+{
+  uint64 span;
+
+  if(pagetable[PX(2, va)] & PTE_V)
+    span = 1L << PXSHIFT(1);
+  else
+    span = 1L << PXSHIFT(2);
+  return (va + span) & ~(span - 1);
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -121,18 +235,59 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = LEAF2PA(*pte, va);
   return pa;
 }
 
-// add a mapping to the kernel page table.
+// Map one megapage (a level-1 leaf PTE) at va to pa; both must be
+// MEGAPGSIZE-aligned. Returns 0 on success, -1 if walk() couldn't
+// allocate the level-1 page-table page.
+static int
+mapmega(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+  pagetable_t l1;
+
+  if(*pte & PTE_V){
+    l1 = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if((l1 = (pagetable_t)kzalloc()) == 0)
+      return -1;
+    *pte = PA2PTE(l1) | PTE_V;
+  }
+  pte = &l1[PX(1, va)];
+  if(*pte & PTE_V)
+    panic("mapmega: remap");
+  *pte = PA2PTE(pa) | perm | PTE_V | PTE_MEGA;
+  return 0;
+}
+
+// add a mapping to the kernel page table, using megapages
+// wherever va and pa are both megapage-aligned.
 // only used when booting.
 // does not flush TLB or enable paging.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 n;
+
+  while(sz > 0){
+    if(va % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && sz >= MEGAPGSIZE){
+      if(mapmega(kpgtbl, va, pa, perm) != 0)
+        panic("kvmmap");
+      n = MEGAPGSIZE;
+    } else {
+      // pages up to the next megapage boundary, or the end.
+      n = MEGAPGSIZE - va % MEGAPGSIZE;
+      if(n > sz)
+        n = sz;
+      if(mappages(kpgtbl, va, n, pa, perm) != 0)
+        panic("kvmmap");
+    }
+    va += n;
+    pa += n;
+    sz -= n;
+  }
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -172,7 +327,8 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never mapped (heap pages
+// not yet touched, see uvmlazy) are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
@@ -184,10 +340,22 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+    if((pte = walk(pagetable, a, 0)) == 0){
+      a = walkskip(pagetable, a) - PGSIZE;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
+    if(*pte & PTE_MEGA){
+      // only whole megapages; see uvmdemote.
+      if(a % MEGAPGSIZE != 0 || a + MEGAPGSIZE > va + npages*PGSIZE)
+        panic("uvmunmap: partial megapage");
+      if(do_free)
+        kfreepages((void*)PTE2PA(*pte), MEGAPGORDER);
+      *pte = 0;
+      a += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -196,6 +364,8 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     }
     *pte = 0;
   }
+  // with ASIDs, returning to user space no longer flushes.
+  uvmflush(pagetable, va, npages);
 }
 
 // create an empty user page table.
@@ -204,10 +374,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -240,12 +409,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kzalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -303,42 +471,219 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
+// Split the megapage at va, whose level-1 PTE is pte, into 512
+// ordinary pages, each with its own reference count, so that
+// they can be unmapped or shared one at a time.
+// Returns the level-0 PTE for the megapage's first page,
+// or 0 if out of memory.
+static pte_t*
+demote(pagetable_t pagetable, uint64 va, pte_t *pte)
+{
+  pagetable_t l0;
+  uint64 pa;
+  uint flags;
+  int i;
+
+  if((l0 = (pagetable_t)kzalloc()) == 0)
+    return 0;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte) & ~PTE_MEGA;
+  ksplit((void*)pa, MEGAPGORDER);
+  for(i = 0; i < 512; i++)
+    l0[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(l0) | PTE_V;
+  uvmflush(pagetable, va, 512);
+  return &l0[0];
+}
+
+// Demote the megapage, if any, that straddles sz, so that
+// uvmdealloc() can then shrink the process to sz.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmdemote(pagetable_t pagetable, uint64 sz)
+{
+  pte_t *pte;
+
+  sz = PGROUNDUP(sz);
+  if(sz % MEGAPGSIZE == 0 || sz >= MAXVA)
+    return 0;
+  if((pte = walk(pagetable, sz, 0)) == 0 || (*pte & PTE_MEGA) == 0)
+    return 0;
+  return demote(pagetable, sz - sz % MEGAPGSIZE, pte) ? 0 : -1;
+}
+
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies only the page table: both processes share
+// the physical pages, and writable ones become
+// read-only copy-on-write pages in both (see uvmcow).
+// old must be the current process's page table.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmcopyrange(old, new, 0, sz, 0);
+}
+
+// Like uvmcopy(), for the page-aligned range [start, end).
+// If shared, writable pages stay writable in both page
+// tables, so that writes by either are seen by the other
+// (MAP_SHARED mappings), instead of turning copy-on-write.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end,
+             int shared)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+  for(i = start; i < end; i += PGSIZE){
+    // untouched heap pages stay lazy in the child too.
+    if((pte = walk(old, i, 0)) == 0){
+      i = walkskip(old, i) - PGSIZE;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    // share megapages page by page, like everything else.
+    if((*pte & PTE_MEGA) && (pte = demote(old, i, pte)) == 0)
+      goto err;
+    if(!shared && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kdup((void*)pa);
   }
+  // the parent may still hold writable TLB entries.
+  uvmflush(old, start, (end - start) / PGSIZE);
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmflush(old, start, (i - start) / PGSIZE);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Resolve a write to the copy-on-write page at va: give the
+// page table a private, writable copy, or just make the page
+// writable if no one else shares it any more.
+// Returns 0 on success, -1 if va is not a copy-on-write
+// page or memory is exhausted.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, PGROUNDDOWN(va), 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+
+  if(krefs((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (char*)pa, PGSIZE);
+    *pte = PA2PTE(mem) | flags;
+    kfree((void*)pa);
+  }
+  uvmflush(pagetable, PGROUNDDOWN(va), 1);
+  return 0;
+}
+
+// Back the whole megapage around va with one zeroed 2 MiB
+// block, if that megapage lies below p->sz and nothing in it
+// is mapped or belongs to a program segment yet.
+// Returns 0 on success, -1 if not possible.
+static int
+uvmlazymega(struct proc *p, uint64 va)
+{
+  uint64 mva = va & ~(uint64)(MEGAPGSIZE - 1);
+  char *mem;
+  int i;
+
+  if(mva + MEGAPGSIZE > p->sz)
+    return -1;
+  for(i = 0; i < p->nseg; i++)
+    if(p->seg[i].va < mva + MEGAPGSIZE && mva < p->seg[i].va + p->seg[i].memsz)
+      return -1;
+  // a level-0 table there means some page in it is in use.
+  if(walk(p->pagetable, mva, 0) != 0)
+    return -1;
+
+  if((mem = kallocpages(MEGAPGORDER)) == 0)
+    return -1;
+  memset(mem, 0, MEGAPGSIZE);
+  if(mapmega(p->pagetable, mva, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfreepages(mem, MEGAPGORDER);
+    return -1;
+  }
+  return 0;
+}
+
+// The work of uvmlazy(), below.
+static int
+uvmfill(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+  int i;
+
+  if(p == 0 || pagetable != p->pagetable)
+    return -1;
+  if((v = mmaplookup(p, va)) == 0 && va >= p->sz)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(v)
+    return mmapfault(p, v, va, pte);
+  if(pte != 0 && (*pte & PTE_V))
+    return -1;
+  for(i = 0; i < p->nseg; i++)
+    if(va >= p->seg[i].va && va < p->seg[i].va + p->seg[i].memsz)
+      return execfault(p, &p->seg[i], va);
+  if(p->megaheap && uvmlazymega(p, va) == 0)
+    return 0;
+  if((mem = kzalloc()) == 0)
+    return -1;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Give the current process the page at va, if va lies below
+// p->sz but was never touched: exec() leaves program segments
+// to be read in by execfault(), and growproc() only reserves
+// heap address space, whose pages start out zeroed. Pages of
+// mmap() regions are handed to mmapfault(), which also marks
+// shared pages dirty on their first write.
+// Returns 0 on success, -1 if va is not such an address or
+// the page cannot be filled.
+int
+uvmlazy(pagetable_t pagetable, uint64 va)
+{
+  if(uvmfill(pagetable, va) < 0)
+    return -1;
+  // the hart may have cached the old invalid entry, and
+  // returning to user space no longer flushes the TLB.
+  uvmflush(pagetable, PGROUNDDOWN(va), 1);
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -352,6 +697,60 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Find the leaf PTE of user page va0 for copyin/copyout, faulting
+// it in like a user access would (lazy heap, exec segments, and for
+// writes copy-on-write). last is the leaf found for the preceding
+// page, or 0: while the copy stays within one level-0 table the next
+// leaf is simply last+1, so long copies walk from the root only
+// once per 2 MiB instead of once per page.
+// Returns 0 if va0 is not accessible to the user.
+static pte_t *
+uvmleaf(pagetable_t pagetable, uint64 va0, pte_t *last, int write)
+{
+  pte_t *pte;
+
+  if(va0 >= MAXVA)
+    return 0;
+  if(last != 0 && (*last & PTE_MEGA) == 0 && (va0 % MEGAPGSIZE) != 0)
+    pte = last + 1;
+  else
+    pte = walk(pagetable, va0, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    if(uvmlazy(pagetable, va0) < 0)
+      return 0;
+    pte = walk(pagetable, va0, 0);
+  }
+  if(write && pte != 0 && (*pte & PTE_COW) && uvmcow(pagetable, va0) < 0)
+    return 0;
+  // first write to a clean page of a MAP_SHARED mapping.
+  if(write && pte != 0 && (*pte & (PTE_V|PTE_W)) == PTE_V)
+    uvmlazy(pagetable, va0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+    return 0;
+  if(write && (*pte & PTE_W) == 0)
+    return 0;
+  return pte;
+}
+
+// Fault in the user pages of [va, va+len) ahead of a copyin
+// (write == 0) or copyout (write == 1) made under a spinlock,
+// where a fault that has to read a file could not sleep, or
+// under an inode lock, where it could deadlock.
+// Returns 0, or -1 if some page is not accessible.
+int
+uvmprefault(pagetable_t pagetable, uint64 va, uint64 len, int write)
+{
+  uint64 a;
+  pte_t *pte = 0;
+
+  if(va + len < va)
+    return -1;
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+    if((pte = uvmleaf(pagetable, a, pte, write)) == 0)
+      return -1;
+  return 0;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -359,17 +758,13 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
-  pte_t *pte;
+  pte_t *pte = 0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    if(va0 >= MAXVA)
-      return -1;
-    pte = walk(pagetable, va0, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
+    if((pte = uvmleaf(pagetable, va0, pte, 1)) == 0)
       return -1;
-    pa0 = PTE2PA(*pte);
+    pa0 = LEAF2PA(*pte, va0);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -389,12 +784,13 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte = 0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pte = uvmleaf(pagetable, va0, pte, 0)) == 0)
       return -1;
+    pa0 = LEAF2PA(*pte, va0);
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
@@ -415,13 +811,14 @@ int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
+  pte_t *pte = 0;
   int got_null = 0;
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pte = uvmleaf(pagetable, va0, pte, 0)) == 0)
       return -1;
+    pa0 = LEAF2PA(*pte, va0);
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
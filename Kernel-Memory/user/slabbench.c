@@ -0,0 +1,164 @@
+// slabbench: run the in-kernel slab microbenchmark on several harts
+// at once and print a scaling table.
+//
+// usage: slabbench [size [n [maxprocs [batch]]]]
+//   size      object size in bytes (default 64)
+//   n         alloc/free pairs per process (default 100000)
+//   maxprocs  largest number of concurrent processes (default 4)
+//   batch     objects live at once (default 16)
+//
+// For each pattern the test runs 1, 2, 4, ... maxprocs processes in
+// parallel, each timing its own slabbench() call. NS/OP is the mean
+// time per alloc or free; MOPS/S is the aggregate rate over the
+// slowest process. The kalloc row times page allocation as a baseline.
+
+#include "kernel/types.h"
+#include "kernel/slabinfo.h"
+#include "user/user.h"
+
+static char *names[SB_NPATTERN] = {
+[SB_LIFO]   "lifo",
+[SB_FIFO]   "fifo",
+[SB_RANDOM] "random",
+[SB_REMOTE] "remote",
+[SB_KALLOC] "kalloc",
+};
+
+// print s left-aligned in a field of width w.
+static void
+col(char *s, int w)
+{
+  int n = strlen(s);
+
+  printf("%s", s);
+  while(n++ < w)
+    printf(" ");
+}
+
+// print x/100 with two decimals, right-aligned in a field of width w.
+static void
+fix2(uint64 x, int w)
+{
+  char buf[24];
+  int i = sizeof(buf) - 1, d = 0;
+
+  buf[i] = 0;
+  do {
+    buf[--i] = '0' + x % 10;
+    x /= 10;
+    if(++d == 2)
+      buf[--i] = '.';
+  } while(x != 0 || d < 3);
+  for(w -= sizeof(buf) - 1 - i; w > 0; w--)
+    printf(" ");
+  printf("%s ", buf + i);
+}
+
+// Run nproc concurrent benchmarks; fill in the mean ns per op and
+// the aggregate throughput in ops/us, both times 100.
+static int
+run(struct slabbench *arg, int nproc, uint64 *nsop, uint64 *mops)
+{
+  struct slabbench sb;
+  int go[2], res[2], i, ok = 1;
+  uint64 sum = 0, max = 0;
+  char c;
+
+  if(pipe(go) < 0 || pipe(res) < 0){
+    fprintf(2, "slabbench: pipe failed\n");
+    exit(1);
+  }
+  for(i = 0; i < nproc; i++){
+    int pid = fork();
+    if(pid < 0){
+      fprintf(2, "slabbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(go[1]);
+      close(res[0]);
+      // wait until the parent has started everyone.
+      read(go[0], &c, 1);
+      sb = *arg;
+      if(slabbench(&sb) < 0)
+        sb.ns = 0;
+      write(res[1], &sb, sizeof(sb));
+      exit(0);
+    }
+  }
+  close(go[0]);
+  close(res[1]);
+  close(go[1]);
+  for(i = 0; i < nproc; i++){
+    if(read(res[0], &sb, sizeof(sb)) != sizeof(sb) || sb.ns == 0){
+      ok = 0;
+      continue;
+    }
+    sum += sb.ns;
+    if(sb.ns > max)
+      max = sb.ns;
+  }
+  close(res[0]);
+  for(i = 0; i < nproc; i++)
+    wait(0);
+  if(!ok)
+    return -1;
+
+  *nsop = sum * 100 / nproc / (2 * (uint64)arg->n);
+  *mops = 2 * (uint64)arg->n * nproc * 1000 * 100 / max;
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct slabbench arg;
+  uint64 nsop, mops, base;
+  int maxprocs = 4, pat, nproc;
+
+  memset(&arg, 0, sizeof(arg));
+  arg.size = 64;
+  arg.n = 100000;
+  arg.batch = 16;
+  if(argc > 1)
+    arg.size = atoi(argv[1]);
+  if(argc > 2)
+    arg.n = atoi(argv[2]);
+  if(argc > 3)
+    maxprocs = atoi(argv[3]);
+  if(argc > 4)
+    arg.batch = atoi(argv[4]);
+  if(arg.size == 0 || arg.n == 0 || maxprocs <= 0 || arg.batch == 0){
+    fprintf(2, "usage: slabbench [size [n [maxprocs [batch]]]]\n");
+    exit(1);
+  }
+
+  printf("object size %d, %d pairs per process, batch %d\n",
+         arg.size, arg.n, arg.batch);
+  col("PATTERN", 8);
+  printf("PROCS    NS/OP    MOPS/S   SPEEDUP\n");
+  for(pat = 0; pat < SB_NPATTERN; pat++){
+    arg.pattern = pat;
+    base = 0;
+    for(nproc = 1; ; nproc *= 2){
+      if(nproc > maxprocs)
+        nproc = maxprocs;
+      col(names[pat], 8);
+      printf("%d", nproc);
+      col("", nproc < 10 ? 4 : 3);
+      if(run(&arg, nproc, &nsop, &mops) < 0){
+        printf("  failed\n");
+        break;
+      }
+      if(base == 0)
+        base = mops;
+      fix2(nsop, 9);
+      fix2(mops, 9);
+      fix2(mops * 100 / base, 9);
+      printf("\n");
+      if(nproc == maxprocs)
+        break;
+    }
+  }
+  exit(0);
+}
@@ -0,0 +1,107 @@
+// slabtop: periodically print slab allocator statistics.
+//
+// usage: slabtop [interval [count]]
+//   interval  ticks between samples (default 10)
+//   count     number of samples, 0 for no limit (default 0)
+//
+// ALLOC/s and FREE/s are per-sample deltas scaled to operations per
+// 10 ticks (about one second).
+
+#include "kernel/types.h"
+#include "kernel/slabinfo.h"
+#include "user/user.h"
+
+#define NCACHE 32
+
+static struct slabinfo cur[NCACHE], prev[NCACHE];
+
+// print s left-aligned in a field of width w.
+static void
+col(char *s, int w)
+{
+  int n = strlen(s);
+
+  printf("%s", s);
+  while(n++ < w)
+    printf(" ");
+}
+
+// print x right-aligned in a field of width w, then a space.
+static void
+num(uint64 x, int w)
+{
+  char buf[24];
+  int i = sizeof(buf) - 1;
+
+  buf[i] = 0;
+  do {
+    buf[--i] = '0' + x % 10;
+  } while((x /= 10) != 0 && i > 0);
+  for(w -= sizeof(buf) - 1 - i; w > 0; w--)
+    printf(" ");
+  printf("%s ", buf + i);
+}
+
+static void
+sample(int n, int nprev, int interval)
+{
+  struct slabinfo *si;
+  uint64 da, df;
+  int i, use;
+
+  col("NAME", 16);
+  printf(" OBJSZ  SIZE OBJ/S PG/S  ACTIVE   TOTAL USE%%  FULL  PART  FREE  ALLOC/s   FREE/s   CONTENDED\n");
+  for(i = 0; i < n; i++){
+    si = &cur[i];
+    da = df = 0;
+    if(i < nprev && strcmp(prev[i].name, si->name) == 0 && interval > 0){
+      da = (si->nalloc - prev[i].nalloc) * 10 / interval;
+      df = (si->nfree - prev[i].nfree) * 10 / interval;
+    }
+    use = si->total_objs ? si->active_objs * 100 / si->total_objs : 0;
+    col(si->name, 16);
+    num(si->object_size, 6);
+    num(si->size, 5);
+    num(si->objs_per_slab, 5);
+    num(si->pages_per_slab, 4);
+    num(si->active_objs, 7);
+    num(si->total_objs, 7);
+    num(use, 4);
+    num(si->nr_full, 5);
+    num(si->nr_partial, 5);
+    num(si->nr_free, 5);
+    num(da, 8);
+    num(df, 8);
+    num(si->ncontended, 11);
+    printf("\n");
+  }
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int interval = 10, count = 0, n, nprev = 0, iter;
+
+  if(argc > 1)
+    interval = atoi(argv[1]);
+  if(argc > 2)
+    count = atoi(argv[2]);
+  if(interval <= 0){
+    fprintf(2, "usage: slabtop [interval [count]]\n");
+    exit(1);
+  }
+
+  for(iter = 0; count == 0 || iter < count; iter++){
+    if((n = slabinfo(cur, NCACHE)) < 0){
+      fprintf(2, "slabtop: slabinfo failed\n");
+      exit(1);
+    }
+    sample(n, nprev, iter > 0 ? interval : 0);
+    memmove(prev, cur, sizeof(cur));
+    nprev = n;
+    if(count == 0 || iter + 1 < count)
+      sleep(interval);
+  }
+  exit(0);
+}